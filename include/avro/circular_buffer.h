@@ -32,6 +32,8 @@ typedef enum {
   // Full means that the provided data cannot fit, and nothing has been written
   // into the buffer.
   CIRCULAR_BUFFER_FULL,
+  // Empty means that there is no data to take out of the buffer.
+  CIRCULAR_BUFFER_EMPTY,
 } circular_buffer_status_t;
 
 circular_buffer_status_t circular_buffer_write(circular_buffer_t *buf,
@@ -43,14 +45,85 @@ uint8_t circular_buffer_read(uint8_t *dest, uint8_t max_len,
 uint8_t circular_buffer_read_and_advance(uint8_t *dest, uint8_t max_len,
                                          circular_buffer_t *buf);
 
+// Single byte fast paths, intended for use in interrupts.
+static inline circular_buffer_status_t
+circular_buffer_push_byte(circular_buffer_t *buf, uint8_t byte);
+static inline circular_buffer_status_t
+circular_buffer_pop_byte(circular_buffer_t *buf, uint8_t *byte);
+static inline circular_buffer_status_t
+circular_buffer_peek_byte(circular_buffer_t *buf, uint8_t *byte);
+
+// Zero-copy access to the backing storage. The peek/consume pair lets a reader
+// look at data in place, while the claim/commit pair lets a writer put data
+// straight into the buffer. Both spans are continuos, so a span can be
+// shorter than the amount of data (or space) if it passes the boundary of the
+// backing storage, and a second call gives the remaining part.
+uint8_t circular_buffer_peek_span(circular_buffer_t *buf, const uint8_t **ptr);
+void circular_buffer_consume(circular_buffer_t *buf, uint8_t amount);
+uint8_t circular_buffer_claim_span(circular_buffer_t *buf, uint8_t **ptr);
+void circular_buffer_commit(circular_buffer_t *buf, uint8_t amount);
+
 // PRIVATE
 
 uint8_t _circular_buffer_read(uint8_t *dest, uint8_t max_len,
                               circular_buffer_t *buf, bool advance);
 
+// The buffers are safe to use with a single producer (e.g. an interrupt) and
+// a single consumer (e.g. the main loop) at the same time. The producer only
+// ever changes the end index, and the consumer only ever changes the start
+// index. Each side loads the index owned by the other side with
+// _CIRCULAR_BUFFER_LOAD before touching the data, and publishes its own index
+// with _CIRCULAR_BUFFER_STORE only after it is done with the data. Hence the
+// data is always in place before the other side can see it, and a slot is
+// never reused before the other side is done with it.
+#ifdef __AVR__
+#include <util/atomic.h>
+
+// AVR does memory accesses in program order, so it is enough to stop the
+// compiler from caching an index or moving data accesses across the index
+// update. Indices wider than a byte take several instructions to access, so
+// interrupts are masked for those few cycles to avoid seeing half an update.
+#define _CIRCULAR_BUFFER_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+#define _CIRCULAR_BUFFER_LOAD(index)                                          \
+  ({                                                                          \
+    __typeof__(index) _value;                                                 \
+    _CIRCULAR_BUFFER_BARRIER();                                               \
+    if (sizeof(index) == 1) {                                                 \
+      _value = *(volatile __typeof__(index) *)&(index);                       \
+    } else {                                                                  \
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {                                     \
+        _value = *(volatile __typeof__(index) *)&(index);                     \
+      }                                                                       \
+    }                                                                         \
+    _CIRCULAR_BUFFER_BARRIER();                                               \
+    _value;                                                                   \
+  })
+
+#define _CIRCULAR_BUFFER_STORE(index, value)                                  \
+  do {                                                                        \
+    __typeof__(index) _value = (value);                                       \
+    _CIRCULAR_BUFFER_BARRIER();                                               \
+    if (sizeof(index) == 1) {                                                 \
+      *(volatile __typeof__(index) *)&(index) = _value;                       \
+    } else {                                                                  \
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {                                     \
+        *(volatile __typeof__(index) *)&(index) = _value;                     \
+      }                                                                       \
+    }                                                                         \
+    _CIRCULAR_BUFFER_BARRIER();                                               \
+  } while (0)
+#else
+// On the host (e.g. when testing) the two sides can be threads running in
+// parallel, so use atomics with acquire/release ordering.
+#define _CIRCULAR_BUFFER_LOAD(index) __atomic_load_n(&(index), __ATOMIC_ACQUIRE)
+#define _CIRCULAR_BUFFER_STORE(index, value)                                  \
+  __atomic_store_n(&(index), (value), __ATOMIC_RELEASE)
+#endif
+
 uint8_t circular_buffer_len(circular_buffer_t *buf) {
-  uint8_t bstart = buf->start;
-  uint8_t bend = buf->end;
+  uint8_t bstart = _CIRCULAR_BUFFER_LOAD(buf->start);
+  uint8_t bend = _CIRCULAR_BUFFER_LOAD(buf->end);
 
   if (bstart <= bend) {
     return bend - bstart;
@@ -61,15 +134,18 @@ uint8_t circular_buffer_len(circular_buffer_t *buf) {
 
 circular_buffer_status_t
 circular_buffer_write(circular_buffer_t *buf, const uint8_t *src, uint8_t len) {
-  uint8_t bstart = buf->start;
+  uint8_t bstart = _CIRCULAR_BUFFER_LOAD(buf->start);
   uint8_t bend = buf->end;
 
   if (bstart <= bend) {
     // Buffer only has continuos data, so we can insert after end and possibly
     // before start.
+    // NB! When wrapping around, one slot before start has to be kept free, as
+    // end catching up with start would make the buffer look empty.
     uint8_t avaliable_continous_back = buf->len - bend;
-    uint8_t avaliable_continous_front = bstart;
-    if (avaliable_continous_back + avaliable_continous_front < len) {
+    uint8_t avaliable_continous_front = bstart > 0 ? bstart - 1 : 0;
+    if (len > avaliable_continous_back &&
+        avaliable_continous_back + avaliable_continous_front < len) {
       // The data cannot fit, so we insert none of it
       return CIRCULAR_BUFFER_FULL;
     }
@@ -91,12 +167,12 @@ circular_buffer_write(circular_buffer_t *buf, const uint8_t *src, uint8_t len) {
       memcpy(buf->buf, src + avaliable_continous_back,
              (len - avaliable_continous_back) * sizeof(uint8_t));
       bend = len - avaliable_continous_back;
-      assert(bend <= bstart);
+      assert(bend < bstart);
     }
   } else {
     // Buffer already has non-continuos data, so we have to insert data between
-    // bend and bstart.
-    uint8_t avaliable_continous = bstart - bend;
+    // bend and bstart, keeping one slot free before start.
+    uint8_t avaliable_continous = bstart - bend - 1;
     if (avaliable_continous < len) {
       // The data cannot fit, so we insert none of it
       return CIRCULAR_BUFFER_FULL;
@@ -105,46 +181,46 @@ circular_buffer_write(circular_buffer_t *buf, const uint8_t *src, uint8_t len) {
     // The data can fit continuosly between bend and bstart
     memcpy(buf->buf + bend, src, len * sizeof(uint8_t));
     bend += len;
-    assert(bend <= bstart);
+    assert(bend < bstart);
   }
 
-  // NB! We have to ensure to update the actual end of the buffer.
-  buf->end = bend;
+  // NB! We have to ensure to update the actual end of the buffer, and only
+  // after the data is in place.
+  _CIRCULAR_BUFFER_STORE(buf->end, bend);
 
   return CIRCULAR_BUFFER_OK;
 }
 
 void circular_buffer_advance(uint8_t amount, circular_buffer_t *buf) {
-  // By reading these values first, we can safely interrupt this function and
-  // append to the end without it "breaking" the datastructure. This is
-  // because buf->end is ONLY increased.
+  // Only the consumer changes start, while end can be changed by the
+  // producer at any point. Hence take a snapshot of end, where any data
+  // written after that is simply not seen by this call.
   uint8_t bstart = buf->start;
-  uint8_t bend = buf->end;
+  uint8_t bend = _CIRCULAR_BUFFER_LOAD(buf->end);
 
   // Saturate amount to max size of buffer, so if amount is greater than
   // amount of data in buffer, we simply "eat" all data, leaving the buffer
   // empty.
   if (bstart <= bend) {
     amount = amount <= bend - bstart ? amount : bend - bstart;
-    buf->start = bstart + amount;
+    _CIRCULAR_BUFFER_STORE(buf->start, bstart + amount);
 
   } else {
     amount =
         amount <= buf->len - bstart + bend ? amount : buf->len - bstart + bend;
 
-    buf->start = (bstart + amount) % buf->len;
+    _CIRCULAR_BUFFER_STORE(buf->start, (bstart + amount) % buf->len);
   }
 }
 
 uint8_t _circular_buffer_read(uint8_t *dest, uint8_t max_len,
                               circular_buffer_t *buf, bool advance) {
 
-  // By reading these values first, we can safely interrupt this function and
-  // append to the end without it "breaking" the datastructure. This is
-  // because writing ONLY changes buf->end, and reading only changes
-  // buf->start.
+  // Only the consumer changes start, while end can be changed by the
+  // producer at any point. Hence take a snapshot of end, where any data
+  // written after that is simply not seen by this call.
   uint8_t bstart = buf->start;
-  uint8_t bend = buf->end;
+  uint8_t bend = _CIRCULAR_BUFFER_LOAD(buf->end);
 
   if (bstart == bend) {
     return 0;
@@ -160,9 +236,9 @@ uint8_t _circular_buffer_read(uint8_t *dest, uint8_t max_len,
       assert(bstart <= bend);
 
       // NB! We have to remember to update the actual buffer start before
-      // exiting. This is an "atomic" operation and will enable the write
+      // exiting, and only after the data is read. This will enable the write
       // routine to write to more of the buffer.
-      buf->start = bstart;
+      _CIRCULAR_BUFFER_STORE(buf->start, bstart);
     }
 
     return read_len;
@@ -183,9 +259,8 @@ uint8_t _circular_buffer_read(uint8_t *dest, uint8_t max_len,
       bstart = (bstart + read_len_back + read_len_front) % buf->len;
 
       // NB! We have to remember to update the actual buffer start before
-      // exiting. This is an "atomic" operation and will enable the write
-      // routine to write to more of the buffer.
-      buf->start = bstart;
+      // exiting, and only after the data is read.
+      _CIRCULAR_BUFFER_STORE(buf->start, bstart);
     }
 
     return read_len_back + read_len_front;
@@ -202,4 +277,318 @@ uint8_t circular_buffer_read_and_advance(uint8_t *dest, uint8_t max_len,
   return _circular_buffer_read(dest, max_len, buf, true);
 }
 
+static inline circular_buffer_status_t
+circular_buffer_push_byte(circular_buffer_t *buf, uint8_t byte) {
+  uint8_t bstart = _CIRCULAR_BUFFER_LOAD(buf->start);
+  uint8_t bend = buf->end;
+
+  if (bend == buf->len) {
+    // End is at the boundary of the backing storage, so the byte goes to the
+    // front. This needs a free slot between the byte and start, else the
+    // buffer would look empty.
+    if (bstart <= 1) {
+      return CIRCULAR_BUFFER_FULL;
+    }
+    bend = 0;
+  } else if (bstart > bend && bend + 1 == bstart) {
+    // Buffer has non-continuos data, and end would catch up with start.
+    return CIRCULAR_BUFFER_FULL;
+  }
+
+  buf->buf[bend] = byte;
+
+  // NB! Only update the actual end after the byte is written.
+  _CIRCULAR_BUFFER_STORE(buf->end, bend + 1);
+
+  return CIRCULAR_BUFFER_OK;
+}
+
+static inline circular_buffer_status_t
+circular_buffer_peek_byte(circular_buffer_t *buf, uint8_t *byte) {
+  uint8_t bstart = buf->start;
+  uint8_t bend = _CIRCULAR_BUFFER_LOAD(buf->end);
+
+  if (bstart == bend) {
+    return CIRCULAR_BUFFER_EMPTY;
+  }
+
+  // Start is at the boundary of the backing storage, so the data continues
+  // from the front.
+  if (bstart == buf->len) {
+    bstart = 0;
+  }
+
+  *byte = buf->buf[bstart];
+
+  return CIRCULAR_BUFFER_OK;
+}
+
+static inline circular_buffer_status_t
+circular_buffer_pop_byte(circular_buffer_t *buf, uint8_t *byte) {
+  uint8_t bstart = buf->start;
+  uint8_t bend = _CIRCULAR_BUFFER_LOAD(buf->end);
+
+  if (bstart == bend) {
+    return CIRCULAR_BUFFER_EMPTY;
+  }
+
+  if (bstart == buf->len) {
+    bstart = 0;
+  }
+
+  *byte = buf->buf[bstart++];
+
+  // Wrap start to the front if the rest of the data is there.
+  if (bstart == buf->len && bend != bstart) {
+    bstart = 0;
+  }
+
+  // NB! Only update the actual start after the byte is read.
+  _CIRCULAR_BUFFER_STORE(buf->start, bstart);
+
+  return CIRCULAR_BUFFER_OK;
+}
+
+uint8_t circular_buffer_peek_span(circular_buffer_t *buf, const uint8_t **ptr) {
+  uint8_t bstart = buf->start;
+  uint8_t bend = _CIRCULAR_BUFFER_LOAD(buf->end);
+
+  if (bstart == bend) {
+    return 0;
+  }
+
+  if (bstart == buf->len) {
+    // Start is at the boundary of the backing storage, so the data continues
+    // from the front.
+    bstart = 0;
+  }
+
+  *ptr = buf->buf + bstart;
+
+  if (bstart < bend) {
+    return bend - bstart;
+  } else {
+    // Non-continuos data, so the span ends at the boundary.
+    return buf->len - bstart;
+  }
+}
+
+void circular_buffer_consume(circular_buffer_t *buf, uint8_t amount) {
+  circular_buffer_advance(amount, buf);
+}
+
+uint8_t circular_buffer_claim_span(circular_buffer_t *buf, uint8_t **ptr) {
+  uint8_t bstart = _CIRCULAR_BUFFER_LOAD(buf->start);
+  uint8_t bend = buf->end;
+
+  if (bstart <= bend && bend < buf->len) {
+    // Buffer only has continuos data, so we can write until the boundary.
+    *ptr = buf->buf + bend;
+    return buf->len - bend;
+  }
+
+  if (bend == buf->len) {
+    // End is at the boundary, so continue from the front.
+    bend = 0;
+  }
+
+  // Keep a free slot before start, else the buffer would look empty.
+  if (bstart <= bend + 1) {
+    return 0;
+  }
+
+  *ptr = buf->buf + bend;
+  return bstart - bend - 1;
+}
+
+void circular_buffer_commit(circular_buffer_t *buf, uint8_t amount) {
+  uint8_t bend = buf->end;
+
+  if (amount == 0) {
+    return;
+  }
+
+  // Mirror claim span, where a full back means the span is at the front.
+  if (bend == buf->len) {
+    bend = 0;
+  }
+
+  // NB! This must only happen after the data is in place.
+  _CIRCULAR_BUFFER_STORE(buf->end, bend + amount);
+}
+
+// GENERATED VARIANT
+
+// Defines a circular buffer type `name##_t` with a compile-time power-of-two
+// size and an index type (index_t) of choice, along with the functions
+// operating on it (`name##_write`, `name##_len`, `name##_advance`,
+// `name##_read`, `name##_read_and_advance`, the single byte
+// `name##_push_byte`, `name##_pop_byte` and `name##_peek_byte`, and the spans
+// `name##_peek_span`, `name##_consume`, `name##_claim_span` and
+// `name##_commit`), mirroring the interface above. Additionally
+// `name##_peek_span_from` peeks at the data from an offset after the start,
+// e.g. to continue scanning past data which is not yet consumed.
+//
+// Instead of start and end indices which wrap at the length of the buffer,
+// this variant uses free-running head (write) and tail (read) counters which
+// simply overflow, and finds the position in the backing storage by masking
+// with (size - 1). This avoids any modulo (a software division on AVR), makes
+// the length a single subtraction, and lets the buffer use all of its slots.
+// The size can be at most half the range of index_t so that a full buffer can
+// be told apart from an empty one, i.e. 128 for uint8_t and 32768 for
+// uint16_t. The buffer takes size bytes plus two indices of RAM, where wider
+// indices are a bit slower as they have to be accessed with interrupts masked.
+//
+// Usage:
+//   CIRCULAR_BUFFER_DEFINE(rx_ring, uint8_t, 64)
+//   CIRCULAR_BUFFER_DEFINE(tx_ring, uint16_t, 512)
+//   rx_ring_t rx;
+//   rx_ring_write(&rx, data, sizeof(data));
+#define CIRCULAR_BUFFER_DEFINE(name, index_t, size)                           \
+  _Static_assert((size) > 0 && ((size) & ((size)-1)) == 0,                    \
+                 #name ": size must be a power of two");                      \
+  _Static_assert((index_t)-1 > 0, #name ": index_t must be unsigned");        \
+  _Static_assert((size) <= ((index_t)-1 >> 1) + 1,                            \
+                 #name ": size is too large for index_t");                    \
+                                                                              \
+  typedef struct {                                                            \
+    index_t head;                                                             \
+    index_t tail;                                                             \
+    uint8_t buf[(size)];                                                      \
+  } name##_t;                                                                 \
+                                                                              \
+  static inline index_t name##_len(name##_t *rb) {                            \
+    return (index_t)(_CIRCULAR_BUFFER_LOAD(rb->head) -                        \
+                     _CIRCULAR_BUFFER_LOAD(rb->tail));                        \
+  }                                                                           \
+                                                                              \
+  static inline circular_buffer_status_t name##_write(                        \
+      name##_t *rb, const uint8_t *src, index_t len) {                        \
+    /* Only the producer changes head, so it is safe to keep a local copy. */ \
+    index_t head = rb->head;                                                  \
+    index_t tail = _CIRCULAR_BUFFER_LOAD(rb->tail);                           \
+    index_t avaliable = (size) - (index_t)(head - tail);                      \
+    if (avaliable < len) {                                                    \
+      /* The data cannot fit, so we insert none of it */                      \
+      return CIRCULAR_BUFFER_FULL;                                            \
+    }                                                                         \
+                                                                              \
+    /* Copy up to the boundary of the backing storage, then the rest (if */   \
+    /* any) to the front. */                                                  \
+    index_t idx = head & ((size)-1);                                          \
+    index_t continous = (size)-idx < len ? (size)-idx : len;                  \
+    memcpy(rb->buf + idx, src, continous);                                    \
+    memcpy(rb->buf, src + continous, len - continous);                        \
+                                                                              \
+    /* NB! Only publish the new head after the data is in place. */           \
+    _CIRCULAR_BUFFER_STORE(rb->head, head + len);                             \
+    return CIRCULAR_BUFFER_OK;                                                \
+  }                                                                           \
+                                                                              \
+  static inline circular_buffer_status_t name##_push_byte(name##_t *rb,       \
+                                                         uint8_t byte) {      \
+    index_t head = rb->head;                                                  \
+    if ((index_t)(head - _CIRCULAR_BUFFER_LOAD(rb->tail)) == (size)) {        \
+      return CIRCULAR_BUFFER_FULL;                                            \
+    }                                                                         \
+    rb->buf[head & ((size)-1)] = byte;                                        \
+    _CIRCULAR_BUFFER_STORE(rb->head, head + 1);                               \
+    return CIRCULAR_BUFFER_OK;                                                \
+  }                                                                           \
+                                                                              \
+  static inline circular_buffer_status_t name##_peek_byte(name##_t *rb,       \
+                                                         uint8_t *byte) {     \
+    index_t tail = rb->tail;                                                  \
+    if (_CIRCULAR_BUFFER_LOAD(rb->head) == tail) {                            \
+      return CIRCULAR_BUFFER_EMPTY;                                           \
+    }                                                                         \
+    *byte = rb->buf[tail & ((size)-1)];                                       \
+    return CIRCULAR_BUFFER_OK;                                                \
+  }                                                                           \
+                                                                              \
+  static inline circular_buffer_status_t name##_pop_byte(name##_t *rb,        \
+                                                        uint8_t *byte) {      \
+    index_t tail = rb->tail;                                                  \
+    if (_CIRCULAR_BUFFER_LOAD(rb->head) == tail) {                            \
+      return CIRCULAR_BUFFER_EMPTY;                                           \
+    }                                                                         \
+    *byte = rb->buf[tail & ((size)-1)];                                       \
+    _CIRCULAR_BUFFER_STORE(rb->tail, tail + 1);                               \
+    return CIRCULAR_BUFFER_OK;                                                \
+  }                                                                           \
+                                                                              \
+  static inline void name##_advance(index_t amount, name##_t *rb) {           \
+    /* Saturate amount to the amount of data in the buffer. */                \
+    index_t tail = rb->tail;                                                  \
+    index_t len = (index_t)(_CIRCULAR_BUFFER_LOAD(rb->head) - tail);          \
+    _CIRCULAR_BUFFER_STORE(rb->tail, tail + (amount <= len ? amount : len));  \
+  }                                                                           \
+                                                                              \
+  static inline index_t name##_peek_span_from(name##_t *rb, index_t offset,   \
+                                              const uint8_t **ptr) {          \
+    index_t tail = rb->tail;                                                  \
+    index_t len = (index_t)(_CIRCULAR_BUFFER_LOAD(rb->head) - tail);          \
+    if (offset >= len) {                                                      \
+      return 0;                                                               \
+    }                                                                         \
+    len -= offset;                                                            \
+    index_t idx = (index_t)(tail + offset) & ((size)-1);                      \
+    *ptr = rb->buf + idx;                                                     \
+    return (size)-idx < len ? (size)-idx : len;                               \
+  }                                                                           \
+                                                                              \
+  static inline index_t name##_peek_span(name##_t *rb, const uint8_t **ptr) { \
+    return name##_peek_span_from(rb, 0, ptr);                                 \
+  }                                                                           \
+  static inline void name##_consume(name##_t *rb, index_t amount) {           \
+    name##_advance(amount, rb);                                               \
+  }                                                                           \
+                                                                              \
+  static inline index_t name##_claim_span(name##_t *rb, uint8_t **ptr) {      \
+    index_t head = rb->head;                                                  \
+    index_t tail = _CIRCULAR_BUFFER_LOAD(rb->tail);                           \
+    index_t avaliable = (size) - (index_t)(head - tail);                      \
+    index_t idx = head & ((size)-1);                                          \
+    *ptr = rb->buf + idx;                                                     \
+    return (size)-idx < avaliable ? (size)-idx : avaliable;                   \
+  }                                                                           \
+                                                                              \
+  static inline void name##_commit(name##_t *rb, index_t amount) {            \
+    /* NB! This must only happen after the data is in place. */               \
+    _CIRCULAR_BUFFER_STORE(rb->head, rb->head + amount);                      \
+  }                                                                           \
+                                                                              \
+  static inline index_t _##name##_read(uint8_t *dest, index_t max_len,        \
+                                       name##_t *rb, bool advance) {          \
+    /* Only the consumer changes tail, so it is safe to keep a local copy. */ \
+    index_t tail = rb->tail;                                                  \
+    index_t len = (index_t)(_CIRCULAR_BUFFER_LOAD(rb->head) - tail);          \
+    index_t read_len = len < max_len ? len : max_len;                         \
+                                                                              \
+    index_t idx = tail & ((size)-1);                                          \
+    index_t continous = (size)-idx < read_len ? (size)-idx : read_len;        \
+    memcpy(dest, rb->buf + idx, continous);                                   \
+    memcpy(dest + continous, rb->buf, read_len - continous);                  \
+                                                                              \
+    if (advance) {                                                            \
+      /* NB! Only release the slots after the data is read. */                \
+      _CIRCULAR_BUFFER_STORE(rb->tail, tail + read_len);                      \
+    }                                                                         \
+    return read_len;                                                          \
+  }                                                                           \
+                                                                              \
+  static inline index_t name##_read(uint8_t *dest, index_t max_len,           \
+                                    name##_t *rb) {                           \
+    return _##name##_read(dest, max_len, rb, false);                          \
+  }                                                                           \
+                                                                              \
+  static inline index_t name##_read_and_advance(                              \
+      uint8_t *dest, index_t max_len, name##_t *rb) {                         \
+    return _##name##_read(dest, max_len, rb, true);                           \
+  }
+
+// Defines a circular buffer with 8-bit indices, see CIRCULAR_BUFFER_DEFINE.
+#define CIRCULAR_BUFFER_POW2_DEFINE(name, size)                               \
+  CIRCULAR_BUFFER_DEFINE(name, uint8_t, size)
+
 #endif /* ifndef AVRO_CIRCULAR_BUFFER_H */
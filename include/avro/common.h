@@ -18,9 +18,12 @@
 #ifndef AVRO_DISABLE_DEBUG
 #include <avr/io.h>
 
-// Port used for showing internal values
+// Port used for showing internal values. NB! This is the port of the keypad
+// by default, so define DEBUG_CUSTOM_PORT to move it when using both.
+#ifndef DEBUG_CUSTOM_PORT
 #define DEBUG_PORT PORTK
 #define DEBUG_DDR DDRK
+#endif
 
 void init_debug() { DEBUG_DDR = 0xff; }
 void write_debug(uint8_t b) { DEBUG_PORT = b; }
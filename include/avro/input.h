@@ -0,0 +1,215 @@
+/******************************************************************************
+ * File:             input.h
+ *
+ * Author:           Ole Martin Ruud
+ * Created:          10/14/26
+ * Description:      Debounced events from the keypad and the rotary button,
+ *                   scanned every millisecond. NB! Uses TIMER2.
+ *****************************************************************************/
+
+#ifndef AVRO_INPUT_H
+#define AVRO_INPUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "circular_buffer.h"
+#include "profile.h"
+#include "keypad.h"
+#include "rotary.h"
+
+// Claim the hardware, see system.h
+#ifdef AVRO_USES_TIMER2
+#error "input.h: TIMER2 is already in use"
+#endif
+#define AVRO_USES_TIMER2
+
+// Time a key is held before it starts repeating, and the time between
+// repeats, in milliseconds.
+#ifndef INPUT_REPEAT_DELAY_MS
+#define INPUT_REPEAT_DELAY_MS 500
+#endif
+#ifndef INPUT_REPEAT_MS
+#define INPUT_REPEAT_MS 100
+#endif
+
+// Bytes of the event queue, which must be a power of two of at most 128. Each
+// event takes 4 bytes, and events are dropped while the queue is full.
+#ifndef INPUT_QUEUE_BYTES
+#define INPUT_QUEUE_BYTES 64
+#endif
+
+// PUBLIC
+
+// Keys 0 to 15 are the keypad, as indexed in KEYPAD_ENCODINGS, followed by
+// the button of the rotary encoder.
+#define INPUT_KEY_BUTTON 16
+
+typedef enum {
+  INPUT_PRESS,
+  INPUT_RELEASE,
+  // Sent while a key is held, after INPUT_REPEAT_DELAY_MS.
+  INPUT_REPEAT,
+} input_event_type_t;
+
+typedef struct {
+  uint8_t type;
+  uint8_t key;
+  // Milliseconds since init_input when the event happened, wrapping around.
+  uint16_t time;
+} input_event_t;
+
+// Starts scanning the keypad and the rotary button. NB! Call after
+// init_keypad and init_rotary, as the rotary button is then sampled by the
+// scan instead of INT4, which makes rotary_read_pressed debounced as well.
+void init_input();
+// Takes the oldest event, returning false if there is none.
+bool input_read_event(input_event_t *event);
+// Returns the debounced state of every key, with a bit set for each held key.
+uint32_t input_read_keys();
+// Milliseconds since init_input, wrapping around.
+uint16_t input_millis();
+
+// PRIVATE
+
+// The smallest prescaler of Timer2 where a millisecond fits in 8 bits, which
+// divides it exactly at the usual clocks (8 at 1 MHz, 64 at 16 MHz).
+#if F_CPU / 8 / 1000 <= 256
+#define _INPUT_PRESCALER 8
+#define _INPUT_CLOCK_SELECT (1 << CS21)
+#elif F_CPU / 32 / 1000 <= 256
+#define _INPUT_PRESCALER 32
+#define _INPUT_CLOCK_SELECT ((1 << CS21) | (1 << CS20))
+#elif F_CPU / 64 / 1000 <= 256
+#define _INPUT_PRESCALER 64
+#define _INPUT_CLOCK_SELECT (1 << CS22)
+#elif F_CPU / 128 / 1000 <= 256
+#define _INPUT_PRESCALER 128
+#define _INPUT_CLOCK_SELECT ((1 << CS22) | (1 << CS20))
+#else
+#define _INPUT_PRESCALER 256
+#define _INPUT_CLOCK_SELECT ((1 << CS22) | (1 << CS21))
+#endif
+// Ticks of a millisecond, rounded to the nearest
+#define _INPUT_TICKS                                                           \
+  ((F_CPU + _INPUT_PRESCALER * 500UL) / (_INPUT_PRESCALER * 1000UL))
+
+_Static_assert(_INPUT_TICKS <= 256, "F_CPU is too high for the input tick");
+_Static_assert((_INPUT_TICKS * _INPUT_PRESCALER * 1000UL > F_CPU
+                    ? _INPUT_TICKS * _INPUT_PRESCALER * 1000UL - F_CPU
+                    : F_CPU - _INPUT_TICKS * _INPUT_PRESCALER * 1000UL) *
+                       100 <
+                   F_CPU,
+               "The input tick is more than 1% off a millisecond");
+
+CIRCULAR_BUFFER_DEFINE(_input_queue, uint8_t, INPUT_QUEUE_BYTES)
+
+_input_queue_t _input_queue = {0};
+
+// Debounced state of each key, and the two bits of a counter for each key
+// counting how many scans in a row it has been different from the state,
+// as a vertical counter where every key is a bit of the same words.
+volatile uint32_t _input_state = 0;
+// NB! The counters start at 3 and roll over to toggle a key, so they are
+// reset to all ones.
+uint32_t _input_count0 = ~(uint32_t)0;
+uint32_t _input_count1 = ~(uint32_t)0;
+
+volatile uint16_t _input_ms = 0;
+uint8_t _input_repeat_key = 0xff;
+uint16_t _input_repeat_at;
+
+void init_input() {
+  // Stop the rotary button from interrupting, as the scan samples it
+  EIMSK &= ~(1 << INT4);
+
+  // Tick every millisecond in CTC mode
+  OCR2A = _INPUT_TICKS - 1;
+  TCCR2A = (1 << WGM21);
+  TCCR2B = _INPUT_CLOCK_SELECT;
+
+  // Enable compare A interrupt
+  TIMSK2 |= (1 << OCIE2A);
+}
+
+bool input_read_event(input_event_t *event) {
+  if (_input_queue_len(&_input_queue) < sizeof(*event))
+    return false;
+  _input_queue_read_and_advance((uint8_t *)event, sizeof(*event),
+                                &_input_queue);
+  return true;
+}
+
+uint32_t input_read_keys() {
+  uint32_t state;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { state = _input_state; }
+  return state;
+}
+
+uint16_t input_millis() {
+  uint16_t ms;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { ms = _input_ms; }
+  return ms;
+}
+
+static inline void _input_emit(uint8_t type, uint8_t key, uint16_t time) {
+  input_event_t event = {type, key, time};
+  _input_queue_write(&_input_queue, (const uint8_t *)&event, sizeof(event));
+}
+
+// Emits an event for every key set in the mask.
+static inline void _input_emit_keys(uint8_t type, uint32_t keys,
+                                    uint16_t time) {
+  for (uint8_t key = 0; keys != 0; ++key, keys >>= 1)
+    if (keys & 1)
+      _input_emit(type, key, time);
+}
+
+ISR(TIMER2_COMPA_vect) {
+  PROFILE_ISR_ENTER(PROFILE_INPUT);
+  uint16_t now = ++_input_ms;
+
+  // The rotary button is active low, like the keypad
+  uint32_t sample = read_keypad();
+  if (!(ROTARY2_PIN & (1 << ROTARY2_PIN_BTN)))
+    sample |= (uint32_t)1 << INPUT_KEY_BUTTON;
+
+  // Count each key which differs from its state, resetting the others, and
+  // toggle the keys having differed for 4 scans in a row. This debounces all
+  // keys with a handful of operations instead of a counter for each.
+  uint32_t state = _input_state;
+  uint32_t changed = state ^ sample;
+  _input_count0 = ~(_input_count0 & changed);
+  _input_count1 = _input_count0 ^ (_input_count1 & changed);
+  changed &= _input_count0 & _input_count1;
+  state ^= changed;
+  _input_state = state;
+
+  uint32_t pressed = changed & state;
+  uint32_t released = changed & ~state;
+  if (pressed & ((uint32_t)1 << INPUT_KEY_BUTTON))
+    _rotary_pressed = true;
+  _input_emit_keys(INPUT_RELEASE, released, now);
+  _input_emit_keys(INPUT_PRESS, pressed, now);
+
+  // Only the key pressed most recently repeats
+  if (pressed) {
+    for (_input_repeat_key = 0; !(pressed & 1); pressed >>= 1)
+      _input_repeat_key++;
+    _input_repeat_at = now + INPUT_REPEAT_DELAY_MS;
+  } else if (_input_repeat_key != 0xff) {
+    if (!(state & ((uint32_t)1 << _input_repeat_key))) {
+      _input_repeat_key = 0xff;
+    } else if ((int16_t)(now - _input_repeat_at) >= 0) {
+      _input_emit(INPUT_REPEAT, _input_repeat_key, now);
+      _input_repeat_at = now + INPUT_REPEAT_MS;
+    }
+  }
+  PROFILE_ISR_EXIT(PROFILE_INPUT);
+}
+
+#endif /* ifndef AVRO_INPUT_H */
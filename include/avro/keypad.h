@@ -9,7 +9,9 @@
 #ifndef AVRO_KEYPAD_H
 #define AVRO_KEYPAD_H
 
+#include <avr/cpufunc.h>
 #include <avr/io.h>
+#include <util/delay.h>
 
 #ifndef KEYPAD_CUSTOM_PORT
 #define KEYPAD_DDR DDRK
@@ -17,11 +19,28 @@
 #define KEYPAD_PIN PINK
 #endif
 
+// Claim the hardware, see system.h
+#ifndef KEYPAD_CUSTOM_PORT
+#ifdef AVRO_USES_PORTK
+#error "keypad.h: PORTK is already in use"
+#endif
+#define AVRO_USES_PORTK
+#endif
+
+// Time to let the columns settle after driving a row low, for long cables
+// where the capacitance makes the pull-ups slow.
+#ifndef KEYPAD_SETTLE_US
+#define KEYPAD_SETTLE_US 0
+#endif
+
 // PUBLIC
 
 void init_keypad();
 uint16_t read_keypad();
 char get_first_symbol(uint16_t mask);
+// Writes the symbol of every key in the mask to symbols, which must have room
+// for 16, and returns the amount written. Useful for chorded shortcuts.
+uint8_t get_symbols(uint16_t mask, char *symbols);
 
 // PRIVATE
 
@@ -45,6 +64,13 @@ uint16_t read_keypad() {
   for (uint8_t row = 0; row < 4; ++row) {
     KEYPAD_PORT &= ~(1 << (row + 4));
 
+    // NB! The pin synchronizer delays inputs by a cycle, so reading right
+    // after writing the port would see the columns before the row went low.
+    _NOP();
+#if KEYPAD_SETTLE_US > 0
+    _delay_us(KEYPAD_SETTLE_US);
+#endif
+
     // Only read last 4 bits (inputs), invert (as they are active low) and
     // finally add to mask with an offset.
     mask |= ((~KEYPAD_PIN & 0x0f) << (4 * row));
@@ -55,14 +81,38 @@ uint16_t read_keypad() {
   return mask;
 }
 
+// Index of the lowest set bit of every nibble
+const uint8_t _KEYPAD_LOWEST_BIT[16] = {
+    0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+};
 
-char get_first_symbol(uint16_t mask) {
-  for (uint8_t i = 0; i < 16; ++i) {
-    if ((mask & (1 << i)) != 0) {
-      return KEYPAD_ENCODINGS[i];
-    }
+// Returns the index of the lowest set bit of a non-zero mask, by looking up
+// the lowest non-zero nibble.
+static inline uint8_t _keypad_lowest_key(uint16_t mask) {
+  uint8_t offset = 0;
+  if ((mask & 0xff) == 0) {
+    mask >>= 8;
+    offset = 8;
   }
-  return ' ';
+  if ((mask & 0x0f) == 0) {
+    mask >>= 4;
+    offset += 4;
+  }
+  return offset + _KEYPAD_LOWEST_BIT[mask & 0x0f];
+}
+
+char get_first_symbol(uint16_t mask) {
+  if (mask == 0)
+    return ' ';
+  return KEYPAD_ENCODINGS[_keypad_lowest_key(mask)];
+}
+
+uint8_t get_symbols(uint16_t mask, char *symbols) {
+  uint8_t len = 0;
+  // Take the lowest key and clear it, until there are no keys left
+  for (; mask != 0; mask &= mask - 1)
+    symbols[len++] = KEYPAD_ENCODINGS[_keypad_lowest_key(mask)];
+  return len;
 }
 
 #endif /* ifndef AVRO_KEYPAD_H */
@@ -1,158 +1,568 @@
-/******************************************************************************
- * File:             lcd.h
- *
- * Author:           Ole Martin Ruud
- * Created:          02/07/21
- * Description:      Communicate with LCD across TWI interface. Based on
- *                   source code provided Richard Antony and Steven Bos in
- *                   CS4120.
- *****************************************************************************/
-
-#ifndef AVRO_LCD_H
-#define AVRO_LCD_H
-
-#include <avr/interrupt.h>
-#include <avr/io.h>
-#include <stdbool.h>
-#include <util/delay.h>
-
-#include <avro/twi.h>
-
-#define LCD_WIDTH 16
-
-// PUBLIC
-
-void init_lcd();
-
-void lcd_clear();
-void lcd_send_command(uint8_t value);
-void lcd_write_char(char value);
-void lcd_write(char *value);
-void lcd_set_cursor(uint8_t col, uint8_t row);
-
-// PRIVATE
-
-// The default TWI address pre-programmed into the PCF8574T on the LCD module
-#define LCD_TWI_ADDRESS 0x27
-
-// LCD command definitions
-#define LCD_CLEARDISPLAY 0x01
-#define LCD_RETURNHOME 0x02
-#define LCD_ENTRYMODESET 0x04
-#define LCD_DISPLAYCONTROL 0x08
-#define LCD_CURSORSHIFT_LEFT 0x10
-#define LCD_CURSORSHIFT_RIGHT 0x14
-#define LCD_FUNCTIONSET 0x20 // Need to set to 4-bit mode
-#define LCD_SETCGRAMADDR 0x40
-#define LCD_SETDDRAMADDR 0x80
-
-// Flags for display entry mode
-#define LCD_ENTRYRIGHT 0x00
-#define LCD_ENTRYLEFT 0x02
-#define LCD_ENTRYSHIFTINCREMENT 0x01
-#define LCD_ENTRYSHIFTDECREMENT 0x00
-
-// Flags for display on/off control
-#define LCD_DISPLAYON 0x04
-#define LCD_DISPLAYOFF 0x00
-#define LCD_CURSORON 0x02
-#define LCD_CURSOROFF 0x00
-#define LCD_BLINKON 0x01
-#define LCD_BLINKOFF 0x00
-
-// Flags for display/cursor shift
-#define LCD_DISPLAYMOVE 0x08
-#define LCD_CURSORMOVE 0x00
-#define LCD_MOVERIGHT 0x04
-#define LCD_MOVELEFT 0x00
-
-// Flags for function set
-#define LCD_8BITMODE 0x10
-#define LCD_4BITMODE 0x00 // Need to set to 4-bit mode
-#define LCD_2LINE 0x08
-#define LCD_1LINE 0x00
-#define LCD_5x10DOTS 0x04
-#define LCD_5x8DOTS 0x00
-
-// Flags for backlight control
-#define LCD_BACKLIGHT 0x08
-#define LCD_NOBACKLIGHT 0x00
-
-// Flags for mode when sending
-#define LCD_COMMAND_MODE 0x00
-#define LCD_DATA_MODE 0x01
-
-#define LCD_RS_BIT 0b00000001     // Register select bit
-#define LCD_RW_BIT 0b00000010     // Read/Write bit
-#define LCD_ENABLE_BIT 0b00000100 // Enable bit
-
-void _send_nibble(uint8_t value);
-void _send_byte(uint8_t value, uint8_t mode);
-
-void init_lcd() {
-  _delay_ms(50);
-
-  // Try to put  into 4 bit mode 3 times for good measure
-  _send_nibble(0x03 << 4);
-  _delay_us(4500);
-  _send_nibble(0x03 << 4);
-  _delay_us(4500);
-  _send_nibble(0x03 << 4);
-  _delay_us(150);
-
-  // Finally, set to 4-bit interface
-  _send_nibble(0x02 << 4);
-
-  // set # lines, font size, etc.
-  // Set 4-bit interface mode.
-  lcd_send_command(LCD_FUNCTIONSET | LCD_4BITMODE | LCD_2LINE | LCD_5x8DOTS);
-
-  // Turn the display on with cursor and blinking by default
-  lcd_send_command(LCD_DISPLAYCONTROL | LCD_DISPLAYON | LCD_CURSORON |
-                   LCD_BLINKON);
-
-  lcd_send_command(LCD_CLEARDISPLAY);
-  _delay_us(2000);
-
-  // Initialize to default text direction (for roman languages)
-  lcd_send_command(LCD_ENTRYMODESET | LCD_ENTRYLEFT | LCD_ENTRYSHIFTDECREMENT);
-
-  lcd_send_command(LCD_RETURNHOME);
-  _delay_us(2000); // this command takes a long time!
-}
-
-void lcd_clear() { _send_byte(LCD_CLEARDISPLAY, LCD_COMMAND_MODE); }
-
-void lcd_send_command(uint8_t value) { _send_byte(value, LCD_COMMAND_MODE); }
-
-void lcd_write_char(char value) { _send_byte(value, LCD_DATA_MODE); }
-
-void lcd_write(char *str) {
-  uint8_t i = 0;
-  while (str[i] != '\0') {
-    _send_byte(str[i++], LCD_DATA_MODE);
-  }
-}
-
-void lcd_set_cursor(uint8_t col, uint8_t row) {
-  uint8_t offset = row == 0 ? 0x00 : 0x40;
-  lcd_send_command(LCD_SETDDRAMADDR | (col + offset));
-}
-
-void _send_byte(uint8_t value, uint8_t mode) {
-  uint8_t high_nibble = value & 0xf0;
-  uint8_t low_nibble = (value << 4) & 0xf0;
-
-  _send_nibble(high_nibble | mode);
-  _send_nibble(low_nibble | mode);
-}
-
-void _send_nibble(uint8_t value) {
-  twi_send_blocking(LCD_TWI_ADDRESS, (value | LCD_BACKLIGHT) | LCD_ENABLE_BIT);
-  _delay_us(1); // enable pulse must be >450ns
-
-  twi_send_blocking(LCD_TWI_ADDRESS, (value | LCD_BACKLIGHT) & ~LCD_ENABLE_BIT);
-  _delay_us(50); // commands need > 37us to settle
-}
-
-#endif /* ifndef AVRO_LCD_H */
+/******************************************************************************
+ * File:             lcd.h
+ *
+ * Author:           Ole Martin Ruud
+ * Created:          02/07/21
+ * Description:      Communicate with LCD across TWI interface. Based on
+ *                   source code provided Richard Antony and Steven Bos in
+ *                   CS4120.
+ *****************************************************************************/
+
+#ifndef AVRO_LCD_H
+#define AVRO_LCD_H
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <util/delay.h>
+
+#include <util/atomic.h>
+
+#include <avro/power.h>
+#include <avro/profile.h>
+#include <avro/twi.h>
+
+// Claim the hardware, see system.h
+#ifdef AVRO_USES_TIMER3
+#error "lcd.h: TIMER3 is already in use"
+#endif
+#define AVRO_USES_TIMER3
+
+#define LCD_WIDTH 16
+#define LCD_HEIGHT 2
+
+// Most characters (or commands) sent in a single TWI transaction.
+#ifndef LCD_BATCH_SIZE
+#define LCD_BATCH_SIZE LCD_WIDTH
+#endif
+
+// Most commands queued by the asynchronous functions at once, which must be a
+// power of two.
+#ifndef LCD_COMMAND_QUEUE_SIZE
+#define LCD_COMMAND_QUEUE_SIZE 16
+#endif
+
+// SCL frequency the TWI runs at, to know how long each byte takes.
+#ifndef LCD_TWI_SCL_HZ
+#define LCD_TWI_SCL_HZ TWI_SCL_HZ
+#endif
+
+// PUBLIC
+
+void init_lcd();
+
+void lcd_clear();
+void lcd_send_command(uint8_t value);
+void lcd_write_char(char value);
+void lcd_write(char *value);
+void lcd_set_cursor(uint8_t col, uint8_t row);
+
+// Queues writing the string at the cursor as a single TWI transaction, and
+// returns the amount of characters queued, at most LCD_BATCH_SIZE. Returns 0
+// while the previous write is still being sent, see lcd_busy.
+uint8_t lcd_write_async(const char *str);
+bool lcd_busy();
+// Sleeps in idle mode until lcd_busy is false, woken by the TWI and Timer3
+// interrupts sending the commands. The blocking functions do this first, as
+// the LCD ignores what it is sent while executing a queued command.
+void lcd_wait();
+
+// A framebuffer of what should be on the display, which is cheap to write to
+// as nothing is sent. lcd_refresh then sends only what changed since the last
+// refresh, in the background. NB! The display should only be changed through
+// the framebuffer once it is in use.
+void lcd_fb_clear();
+void lcd_fb_write(uint8_t col, uint8_t row, const char *str);
+void lcd_fb_write_char(uint8_t col, uint8_t row, char value);
+
+// Queues sending the changed runs of characters, each after a single
+// LCD_SETDDRAMADDR, as much as fits in a batch. Returns false if nothing was
+// queued, either because nothing changed or the previous batch is still being
+// sent. Call this regularly, e.g. from the main loop.
+bool lcd_refresh();
+
+// Asynchronous versions of init_lcd, lcd_send_command and lcd_clear, which
+// queue the commands to be sent in the background, each after the previous
+// one is done executing (as timed by Timer3). The others return false if the
+// queue is full. lcd_busy is true until every command is sent and done.
+void init_lcd_async();
+bool lcd_send_command_async(uint8_t value);
+bool lcd_clear_async();
+
+// PRIVATE
+
+// The default TWI address pre-programmed into the PCF8574T on the LCD module
+#define LCD_TWI_ADDRESS 0x27
+
+// LCD command definitions
+#define LCD_CLEARDISPLAY 0x01
+#define LCD_RETURNHOME 0x02
+#define LCD_ENTRYMODESET 0x04
+#define LCD_DISPLAYCONTROL 0x08
+#define LCD_CURSORSHIFT_LEFT 0x10
+#define LCD_CURSORSHIFT_RIGHT 0x14
+#define LCD_FUNCTIONSET 0x20 // Need to set to 4-bit mode
+#define LCD_SETCGRAMADDR 0x40
+#define LCD_SETDDRAMADDR 0x80
+
+// Flags for display entry mode
+#define LCD_ENTRYRIGHT 0x00
+#define LCD_ENTRYLEFT 0x02
+#define LCD_ENTRYSHIFTINCREMENT 0x01
+#define LCD_ENTRYSHIFTDECREMENT 0x00
+
+// Flags for display on/off control
+#define LCD_DISPLAYON 0x04
+#define LCD_DISPLAYOFF 0x00
+#define LCD_CURSORON 0x02
+#define LCD_CURSOROFF 0x00
+#define LCD_BLINKON 0x01
+#define LCD_BLINKOFF 0x00
+
+// Flags for display/cursor shift
+#define LCD_DISPLAYMOVE 0x08
+#define LCD_CURSORMOVE 0x00
+#define LCD_MOVERIGHT 0x04
+#define LCD_MOVELEFT 0x00
+
+// Flags for function set
+#define LCD_8BITMODE 0x10
+#define LCD_4BITMODE 0x00 // Need to set to 4-bit mode
+#define LCD_2LINE 0x08
+#define LCD_1LINE 0x00
+#define LCD_5x10DOTS 0x04
+#define LCD_5x8DOTS 0x00
+
+// Flags for backlight control
+#define LCD_BACKLIGHT 0x08
+#define LCD_NOBACKLIGHT 0x00
+
+// Flags for mode when sending
+#define LCD_COMMAND_MODE 0x00
+#define LCD_DATA_MODE 0x01
+
+#define LCD_RS_BIT 0b00000001     // Register select bit
+#define LCD_RW_BIT 0b00000010     // Read/Write bit
+#define LCD_ENABLE_BIT 0b00000100 // Enable bit
+
+// Each byte is sent as two nibbles, each written with and without the enable
+// bit to strobe it into the LCD. On a fast bus, the last write is repeated to
+// give the LCD the 37us it needs to settle before the next byte.
+#define _LCD_BYTE_TIME_US (9 * 1000000UL / LCD_TWI_SCL_HZ)
+#if _LCD_BYTE_TIME_US >= 37
+#define _LCD_SETTLE_WRITES 0
+#else
+#define _LCD_SETTLE_WRITES                                                     \
+  ((37 + _LCD_BYTE_TIME_US - 1) / _LCD_BYTE_TIME_US - 1)
+#endif
+#define _LCD_WRITES_PER_BYTE (4 + _LCD_SETTLE_WRITES)
+
+void _send_nibble(uint8_t value);
+void _send_byte(uint8_t value, uint8_t mode);
+
+uint8_t _lcd_batch[LCD_BATCH_SIZE * _LCD_WRITES_PER_BYTE];
+twi_transaction_t _lcd_transaction = {.status = READY};
+
+// What should be on the display, and what is on it, as far as we know. Zero
+// is never written to the panel, so it marks a character as unknown.
+char _lcd_frame[LCD_HEIGHT][LCD_WIDTH];
+char _lcd_panel[LCD_HEIGHT][LCD_WIDTH];
+
+// How long (in microseconds) the LCD takes to execute each command
+#define _LCD_SLOW_COMMAND_US 1520
+#define _LCD_COMMAND_US 37
+
+static inline bool _lcd_is_slow_command(uint8_t value) {
+  // Clear display and return home, where the lowest bit of return home is
+  // ignored.
+  return value == LCD_CLEARDISPLAY || (value & 0xfe) == LCD_RETURNHOME;
+}
+
+// Flag for queued commands which are only the high nibble, as used when
+// setting 4-bit mode.
+#define _LCD_NIBBLE 0x80
+
+typedef struct {
+  uint8_t value;
+  // The mode, possibly with _LCD_NIBBLE
+  uint8_t flags;
+  // How long to wait after sending it
+  uint16_t delay_us;
+} _lcd_command_t;
+
+// Queue of commands, where the command at the tail is the next to be sent.
+_lcd_command_t _lcd_commands[LCD_COMMAND_QUEUE_SIZE];
+volatile uint8_t _lcd_commands_head = 0;
+volatile uint8_t _lcd_commands_tail = 0;
+// Set while commands are being sent, or waited for.
+volatile bool _lcd_commands_running = false;
+
+#define _LCD_COMMANDS_MASK (LCD_COMMAND_QUEUE_SIZE - 1)
+
+void init_lcd() {
+  _delay_ms(50);
+
+  // Try to put  into 4 bit mode 3 times for good measure
+  _send_nibble(0x03 << 4);
+  _delay_us(4500);
+  _send_nibble(0x03 << 4);
+  _delay_us(4500);
+  _send_nibble(0x03 << 4);
+  _delay_us(150);
+
+  // Finally, set to 4-bit interface
+  _send_nibble(0x02 << 4);
+
+  // set # lines, font size, etc.
+  // Set 4-bit interface mode.
+  lcd_send_command(LCD_FUNCTIONSET | LCD_4BITMODE | LCD_2LINE | LCD_5x8DOTS);
+
+  // Turn the display on with cursor and blinking by default
+  lcd_send_command(LCD_DISPLAYCONTROL | LCD_DISPLAYON | LCD_CURSORON |
+                   LCD_BLINKON);
+
+  lcd_send_command(LCD_CLEARDISPLAY);
+
+  // Initialize to default text direction (for roman languages)
+  lcd_send_command(LCD_ENTRYMODESET | LCD_ENTRYLEFT | LCD_ENTRYSHIFTDECREMENT);
+
+  lcd_send_command(LCD_RETURNHOME);
+
+  // The display was cleared
+  lcd_fb_clear();
+  memset(_lcd_panel, ' ', sizeof(_lcd_panel));
+}
+
+void lcd_clear() { lcd_send_command(LCD_CLEARDISPLAY); }
+
+void lcd_send_command(uint8_t value) {
+  _send_byte(value, LCD_COMMAND_MODE);
+  // NB! The LCD ignores anything sent while it is executing a slow command.
+  if (_lcd_is_slow_command(value))
+    _delay_us(_LCD_SLOW_COMMAND_US);
+}
+
+void lcd_write_char(char value) { _send_byte(value, LCD_DATA_MODE); }
+
+// Encodes a byte as the writes to the PCF8574 which strobe it into the LCD,
+// returning the amount of writes.
+static inline uint8_t _lcd_encode_byte(uint8_t *buf, uint8_t value,
+                                       uint8_t mode) {
+  uint8_t high_nibble = (value & 0xf0) | mode | LCD_BACKLIGHT;
+  uint8_t low_nibble = ((value << 4) & 0xf0) | mode | LCD_BACKLIGHT;
+  uint8_t i = 0;
+
+  // The enable pulse must be >450ns, which every write takes on its own
+  buf[i++] = high_nibble | LCD_ENABLE_BIT;
+  buf[i++] = high_nibble;
+  buf[i++] = low_nibble | LCD_ENABLE_BIT;
+  buf[i++] = low_nibble;
+#if _LCD_SETTLE_WRITES > 0
+  for (uint8_t j = 0; j < _LCD_SETTLE_WRITES; ++j)
+    buf[i++] = low_nibble;
+#endif
+
+  return i;
+}
+
+// Encodes as much of the string as fits in a batch, returning the amount of
+// characters encoded.
+static inline uint8_t _lcd_encode_string(uint8_t *buf, uint8_t *len,
+                                         const char *str) {
+  uint8_t count = 0;
+  *len = 0;
+  while (str[count] != '\0' && count < LCD_BATCH_SIZE) {
+    *len += _lcd_encode_byte(buf + *len, str[count++], LCD_DATA_MODE);
+  }
+  return count;
+}
+
+void lcd_write(char *str) {
+  // Send the string a batch at a time, which is one transaction instead of
+  // four for each character.
+  uint8_t buf[LCD_BATCH_SIZE * _LCD_WRITES_PER_BYTE];
+  uint8_t len;
+  uint8_t count;
+  lcd_wait();
+  while ((count = _lcd_encode_string(buf, &len, str)) > 0) {
+    twi_write_read_blocking(LCD_TWI_ADDRESS, buf, len, NULL, 0);
+    str += count;
+  }
+}
+
+bool lcd_busy() {
+  return _lcd_commands_running || _lcd_transaction.status == PENDING;
+}
+
+void lcd_wait() { POWER_IDLE_WHILE(lcd_busy()); }
+
+void _lcd_commands_next();
+
+// Starts sending the queued commands, unless they are already being sent. NB!
+// The commands share the batch and transaction with the asynchronous writes,
+// so they wait for a write in progress, which starts them when done. Must be
+// called with interrupts disabled.
+static inline void _lcd_commands_start() {
+  if (!_lcd_commands_running && _lcd_transaction.status != PENDING)
+    _lcd_commands_next();
+}
+
+static void _lcd_write_done(twi_transaction_t *transaction) {
+  (void)transaction;
+  _lcd_commands_start();
+}
+
+static inline bool _lcd_queue_batch(uint8_t len,
+                                    void (*callback)(twi_transaction_t *)) {
+  _lcd_transaction.addr = LCD_TWI_ADDRESS;
+  _lcd_transaction.write_buf = _lcd_batch;
+  _lcd_transaction.write_len = len;
+  _lcd_transaction.read_buf = NULL;
+  _lcd_transaction.read_len = 0;
+  _lcd_transaction.callback = callback;
+  return twi_queue(&_lcd_transaction);
+}
+
+uint8_t lcd_write_async(const char *str) {
+  if (lcd_busy()) {
+    return 0;
+  }
+
+  uint8_t len;
+  uint8_t count = _lcd_encode_string(_lcd_batch, &len, str);
+  if (count == 0) {
+    return 0;
+  }
+
+  return _lcd_queue_batch(len, _lcd_write_done) ? count : 0;
+}
+
+void lcd_fb_clear() { memset(_lcd_frame, ' ', sizeof(_lcd_frame)); }
+
+void lcd_fb_write(uint8_t col, uint8_t row, const char *str) {
+  assert(row < LCD_HEIGHT);
+  while (*str != '\0' && col < LCD_WIDTH) {
+    _lcd_frame[row][col++] = *str++;
+  }
+}
+
+void lcd_fb_write_char(uint8_t col, uint8_t row, char value) {
+  assert(row < LCD_HEIGHT && col < LCD_WIDTH);
+  _lcd_frame[row][col] = value;
+}
+
+static void _lcd_refresh_done(twi_transaction_t *transaction) {
+  // We do not know what made it to the panel, so send everything again
+  if (transaction->status != READY)
+    memset(_lcd_panel, 0, sizeof(_lcd_panel));
+  _lcd_commands_start();
+}
+
+bool lcd_refresh() {
+  if (lcd_busy()) {
+    return false;
+  }
+
+  uint8_t len = 0;
+  uint8_t count = 0;
+
+  for (uint8_t row = 0; row < LCD_HEIGHT; ++row) {
+    uint8_t col = 0;
+    while (col < LCD_WIDTH) {
+      // Find the next run of changed characters, where a single unchanged
+      // character within it is resent, as it costs the same as moving the
+      // cursor past it.
+      while (col < LCD_WIDTH && _lcd_frame[row][col] == _lcd_panel[row][col])
+        col++;
+      if (col == LCD_WIDTH)
+        break;
+
+      uint8_t end = col + 1;
+      while (end < LCD_WIDTH &&
+             (_lcd_frame[row][end] != _lcd_panel[row][end] ||
+              (end + 1 < LCD_WIDTH &&
+               _lcd_frame[row][end + 1] != _lcd_panel[row][end + 1])))
+        end++;
+
+      // Send as much of the run as fits in the batch, and the rest next time
+      if (count + 1 >= LCD_BATCH_SIZE)
+        goto send;
+      if (end - col > LCD_BATCH_SIZE - count - 1)
+        end = col + LCD_BATCH_SIZE - count - 1;
+
+      uint8_t offset = row == 0 ? 0x00 : 0x40;
+      len += _lcd_encode_byte(_lcd_batch + len,
+                              LCD_SETDDRAMADDR | (col + offset),
+                              LCD_COMMAND_MODE);
+      count++;
+      for (; col < end; ++col) {
+        len += _lcd_encode_byte(_lcd_batch + len, _lcd_frame[row][col],
+                                LCD_DATA_MODE);
+        // Assume the panel gets it, unless the transaction fails
+        _lcd_panel[row][col] = _lcd_frame[row][col];
+        count++;
+      }
+    }
+  }
+
+send:
+  if (len == 0) {
+    return false;
+  }
+  if (!_lcd_queue_batch(len, _lcd_refresh_done)) {
+    // The TWI queue is full, so the panel was not changed after all
+    memset(_lcd_panel, 0, sizeof(_lcd_panel));
+    return false;
+  }
+  return true;
+}
+
+void lcd_set_cursor(uint8_t col, uint8_t row) {
+  uint8_t offset = row == 0 ? 0x00 : 0x40;
+  lcd_send_command(LCD_SETDDRAMADDR | (col + offset));
+}
+
+// Starts Timer3 to send the next command once the delay has passed, in CTC
+// mode with prescaler 64 (4us at 16 MHz, up to 262ms).
+static inline void _lcd_timer_start(uint16_t delay_us) {
+  uint32_t ticks = ((uint32_t)delay_us * (F_CPU / 1000) + 63999) / 64000;
+  TCCR3A = 0;
+  TCCR3B = 0;
+  TCNT3 = 0;
+  OCR3A = ticks > 0 ? ticks - 1 : 0;
+  TIFR3 = (1 << OCF3A);
+  TIMSK3 |= (1 << OCIE3A);
+  TCCR3B = (1 << WGM32) | (1 << CS31) | (1 << CS30);
+}
+
+static void _lcd_command_sent(twi_transaction_t *transaction) {
+  (void)transaction;
+  _lcd_command_t *command = &_lcd_commands[_lcd_commands_tail &
+                                           _LCD_COMMANDS_MASK];
+  uint16_t delay_us = command->delay_us;
+  _lcd_commands_tail++;
+
+  // Sending the next command takes longer than short delays anyway
+  if (delay_us > _LCD_BYTE_TIME_US) {
+    _lcd_timer_start(delay_us);
+  } else {
+    _lcd_commands_next();
+  }
+}
+
+// Sends the command at the tail of the queue, if any. NB! Must be called with
+// interrupts disabled.
+void _lcd_commands_next() {
+  if (_lcd_commands_tail == _lcd_commands_head) {
+    _lcd_commands_running = false;
+    return;
+  }
+  _lcd_commands_running = true;
+
+  _lcd_command_t *command = &_lcd_commands[_lcd_commands_tail &
+                                           _LCD_COMMANDS_MASK];
+  uint8_t mode = command->flags & ~_LCD_NIBBLE;
+  uint8_t len;
+  if (command->flags & _LCD_NIBBLE) {
+    uint8_t nibble = (command->value & 0xf0) | mode | LCD_BACKLIGHT;
+    _lcd_batch[0] = nibble | LCD_ENABLE_BIT;
+    _lcd_batch[1] = nibble;
+    len = 2;
+  } else {
+    len = _lcd_encode_byte(_lcd_batch, command->value, mode);
+  }
+
+  if (!_lcd_queue_batch(len, _lcd_command_sent)) {
+    // The TWI queue is full, so try again a bit later
+    _lcd_timer_start(_LCD_SLOW_COMMAND_US);
+  }
+}
+
+ISR(TIMER3_COMPA_vect) {
+  PROFILE_ISR_ENTER(PROFILE_LCD);
+  // One shot, so stop the timer until the next delay
+  TCCR3B = 0;
+  TIMSK3 &= ~(1 << OCIE3A);
+  _lcd_commands_next();
+  PROFILE_ISR_EXIT(PROFILE_LCD);
+}
+
+static inline bool _lcd_queue_command(uint8_t value, uint8_t flags,
+                                      uint16_t delay_us) {
+  bool queued = false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t head = _lcd_commands_head;
+    if ((uint8_t)(head - _lcd_commands_tail) < LCD_COMMAND_QUEUE_SIZE) {
+      _lcd_command_t *command = &_lcd_commands[head & _LCD_COMMANDS_MASK];
+      command->value = value;
+      command->flags = flags;
+      command->delay_us = delay_us;
+      _lcd_commands_head = head + 1;
+      queued = true;
+
+      _lcd_commands_start();
+    }
+  }
+
+  return queued;
+}
+
+bool lcd_send_command_async(uint8_t value) {
+  uint16_t delay_us =
+      _lcd_is_slow_command(value) ? _LCD_SLOW_COMMAND_US : _LCD_COMMAND_US;
+  return _lcd_queue_command(value, LCD_COMMAND_MODE, delay_us);
+}
+
+bool lcd_clear_async() { return lcd_send_command_async(LCD_CLEARDISPLAY); }
+
+void init_lcd_async() {
+  _Static_assert(LCD_COMMAND_QUEUE_SIZE >= 8,
+                 "The commands of init_lcd_async must fit in the queue");
+
+  // Wait for the LCD to power up before sending anything, as in init_lcd
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    _lcd_commands_running = true;
+    _lcd_timer_start(50000);
+  }
+
+  // Try to put into 4 bit mode 3 times for good measure, and then set it
+  _lcd_queue_command(0x03 << 4, LCD_COMMAND_MODE | _LCD_NIBBLE, 4500);
+  _lcd_queue_command(0x03 << 4, LCD_COMMAND_MODE | _LCD_NIBBLE, 4500);
+  _lcd_queue_command(0x03 << 4, LCD_COMMAND_MODE | _LCD_NIBBLE, 150);
+  _lcd_queue_command(0x02 << 4, LCD_COMMAND_MODE | _LCD_NIBBLE,
+                     _LCD_COMMAND_US);
+
+  lcd_send_command_async(LCD_FUNCTIONSET | LCD_4BITMODE | LCD_2LINE |
+                         LCD_5x8DOTS);
+  lcd_send_command_async(LCD_DISPLAYCONTROL | LCD_DISPLAYON | LCD_CURSORON |
+                         LCD_BLINKON);
+  lcd_send_command_async(LCD_CLEARDISPLAY);
+  lcd_send_command_async(LCD_ENTRYMODESET | LCD_ENTRYLEFT |
+                         LCD_ENTRYSHIFTDECREMENT);
+
+  // The display is cleared once the commands are done
+  lcd_fb_clear();
+  memset(_lcd_panel, ' ', sizeof(_lcd_panel));
+}
+
+void _send_byte(uint8_t value, uint8_t mode) {
+  uint8_t buf[_LCD_WRITES_PER_BYTE];
+  uint8_t len = _lcd_encode_byte(buf, value, mode);
+  lcd_wait();
+
+  // Both nibbles in a single transaction, instead of one for each write
+  twi_write_read_blocking(LCD_TWI_ADDRESS, buf, len, NULL, 0);
+}
+
+void _send_nibble(uint8_t value) {
+  twi_send_blocking(LCD_TWI_ADDRESS, (value | LCD_BACKLIGHT) | LCD_ENABLE_BIT);
+  _delay_us(1); // enable pulse must be >450ns
+
+  twi_send_blocking(LCD_TWI_ADDRESS, (value | LCD_BACKLIGHT) & ~LCD_ENABLE_BIT);
+  _delay_us(50); // commands need > 37us to settle
+}
+
+#endif /* ifndef AVRO_LCD_H */
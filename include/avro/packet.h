@@ -0,0 +1,243 @@
+/******************************************************************************
+ * File:             packet.h
+ *
+ * Author:           Ole Martin Ruud
+ * Created:          10/14/26
+ * Description:      Binary packets sent over USART, framed with COBS and
+ *                   checked with a CRC16.
+ *****************************************************************************/
+
+#ifndef AVRO_PACKET_H
+#define AVRO_PACKET_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __AVR__
+#include <util/crc16.h>
+#else
+// The C equivalent of _crc16_update given by avr-libc, so the framing can be
+// tested on the host.
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a) {
+  crc ^= a;
+  for (uint8_t i = 0; i < 8; ++i)
+    crc = crc & 1 ? (crc >> 1) ^ 0xa001 : crc >> 1;
+  return crc;
+}
+#endif
+
+#include "usart.h"
+
+// Each packet is sent as its payload followed by the CRC16 (as by
+// _crc16_update, starting at 0xffff) of it, least significant byte first,
+// which is then COBS (Consistent Overhead Byte Stuffing) encoded and
+// terminated by a zero byte. COBS has an overhead of a single byte for up to
+// 254 bytes, and never sends a zero within the packet, so the receiver can
+// always find the start of the next packet.
+
+// Largest payload which can be sent or received.
+#ifndef PACKET_MAX_PAYLOAD
+#define PACKET_MAX_PAYLOAD 64
+#endif
+
+// How long sending a packet waits for room in the send buffer, where 0 means
+// waiting forever, see usart_send_bytes_timeout.
+#ifndef PACKET_SEND_TIMEOUT_MS
+#define PACKET_SEND_TIMEOUT_MS 0
+#endif
+
+// PUBLIC
+
+// Called with the payload of each valid packet received.
+typedef void (*packet_callback_t)(const uint8_t *payload, uint8_t len);
+
+// State of the packets being received on a port.
+typedef struct {
+  usart_port_t port;
+  packet_callback_t callback;
+  // Decoded payload and CRC of the current packet
+  uint8_t buf[PACKET_MAX_PAYLOAD + 2];
+  uint16_t len;
+  // Bytes left of the current COBS block, and its code
+  uint8_t remaining;
+  uint8_t code;
+  // Set when the current packet is too long, dropping it at the next zero.
+  bool overflow;
+  // Amount of packets dropped due to a bad CRC, COBS coding or length.
+  uint16_t dropped;
+} packet_receiver_t;
+
+void packet_receiver_init(packet_receiver_t *receiver, usart_port_t port,
+                          packet_callback_t callback);
+
+// Decodes all data received so far, calling the callback of the receiver for
+// each valid packet. Call this regularly from the main loop.
+void packet_poll(packet_receiver_t *receiver);
+
+// Encodes and queues a packet to be sent, returning false if it could not be
+// queued within PACKET_SEND_TIMEOUT_MS. The payload is encoded directly into
+// the send buffer without being copied.
+bool packet_send(const uint8_t *payload, uint8_t len);
+bool packet_port_send(usart_port_t port, const uint8_t *payload, uint8_t len);
+
+// PRIVATE
+
+// Longest run of non-zero bytes in a COBS block.
+#define _PACKET_COBS_MAX_RUN 254
+
+// Set when a packet was cut short, so the next packet first sends a zero to
+// end it.
+bool _packet_resync[USART_NUM_PORTS] = {false};
+
+void packet_receiver_init(packet_receiver_t *receiver, usart_port_t port,
+                          packet_callback_t callback) {
+  assert(port < USART_NUM_PORTS);
+  receiver->port = port;
+  receiver->callback = callback;
+  receiver->len = 0;
+  receiver->remaining = 0;
+  receiver->code = 0;
+  receiver->overflow = false;
+  receiver->dropped = 0;
+}
+
+static inline void _packet_receive_end(packet_receiver_t *receiver) {
+  // NB! A zero byte right after another one is an empty packet, which is
+  // ignored as it is used to resynchronize.
+  if (receiver->len == 0 && receiver->code == 0 && !receiver->overflow)
+    return;
+
+  bool valid = !receiver->overflow && receiver->remaining == 0 &&
+               receiver->len >= 2;
+  if (valid) {
+    uint16_t crc = 0xffff;
+    for (uint16_t i = 0; i < receiver->len - 2; ++i)
+      crc = _crc16_update(crc, receiver->buf[i]);
+    valid = receiver->buf[receiver->len - 2] == (crc & 0xff) &&
+            receiver->buf[receiver->len - 1] == (crc >> 8);
+  }
+
+  if (valid) {
+    receiver->callback(receiver->buf, receiver->len - 2);
+  } else if (receiver->dropped < UINT16_MAX) {
+    receiver->dropped++;
+  }
+
+  receiver->len = 0;
+  receiver->remaining = 0;
+  receiver->code = 0;
+  receiver->overflow = false;
+}
+
+static inline void _packet_receive_data(packet_receiver_t *receiver,
+                                        uint8_t byte) {
+  if (receiver->len < sizeof(receiver->buf)) {
+    receiver->buf[receiver->len++] = byte;
+  } else {
+    receiver->overflow = true;
+  }
+}
+
+static inline void _packet_receive_byte(packet_receiver_t *receiver,
+                                        uint8_t byte) {
+  if (byte == 0) {
+    _packet_receive_end(receiver);
+  } else if (receiver->remaining == 0) {
+    // Start of a new block, where the previous block ended with a zero
+    // unless it was the first or a full run.
+    if (receiver->code != 0 && receiver->code != _PACKET_COBS_MAX_RUN + 1)
+      _packet_receive_data(receiver, 0);
+    receiver->code = byte;
+    receiver->remaining = byte - 1;
+  } else {
+    _packet_receive_data(receiver, byte);
+    receiver->remaining--;
+  }
+}
+
+void packet_poll(packet_receiver_t *receiver) {
+  _usart_rx_ring_t *ring = &_usart_recv_buffer[receiver->port];
+  const uint8_t *span;
+  uint16_t span_len;
+
+  // Decode directly from the receive buffer
+  while ((span_len = _usart_rx_ring_peek_span(ring, &span)) > 0) {
+    for (uint16_t i = 0; i < span_len; ++i)
+      _packet_receive_byte(receiver, span[i]);
+    _usart_rx_ring_consume(ring, span_len);
+  }
+}
+
+// Sends bytes from to to of the payload followed by the CRC, returning if
+// everything was queued.
+static inline bool _packet_send_range(usart_port_t port, const uint8_t *payload,
+                                      uint8_t len, const uint8_t *crc,
+                                      uint16_t from, uint16_t to) {
+  if (from < len) {
+    uint8_t end = to < len ? to : len;
+    if (usart_port_send_bytes_timeout(port, payload + from, end - from,
+                                      PACKET_SEND_TIMEOUT_MS) != end - from)
+      return false;
+    from = end;
+  }
+  if (from < to) {
+    if (usart_port_send_bytes_timeout(port, crc + from - len, to - from,
+                                      PACKET_SEND_TIMEOUT_MS) != to - from)
+      return false;
+  }
+  return true;
+}
+
+static inline bool _packet_send_byte(usart_port_t port, uint8_t byte) {
+  return usart_port_send_bytes_timeout(port, &byte, 1,
+                                       PACKET_SEND_TIMEOUT_MS) == 1;
+}
+
+bool packet_port_send(usart_port_t port, const uint8_t *payload, uint8_t len) {
+  assert(len <= PACKET_MAX_PAYLOAD);
+
+  uint16_t crc_value = 0xffff;
+  for (uint8_t i = 0; i < len; ++i)
+    crc_value = _crc16_update(crc_value, payload[i]);
+  const uint8_t crc[2] = {crc_value & 0xff, crc_value >> 8};
+
+  if (_packet_resync[port]) {
+    if (!_packet_send_byte(port, 0))
+      return false;
+    _packet_resync[port] = false;
+  }
+
+  // Encode the payload and CRC as one stream, sending each block as its code
+  // followed by its run of non-zero bytes straight from the payload.
+  uint16_t total = len + 2;
+  uint16_t start = 0;
+  bool ok = true;
+  while (ok) {
+    uint16_t end = start;
+    while (end < total && end - start < _PACKET_COBS_MAX_RUN &&
+           (end < len ? payload[end] : crc[end - len]) != 0)
+      end++;
+
+    ok = _packet_send_byte(port, end - start + 1) &&
+         _packet_send_range(port, payload, len, crc, start, end);
+
+    if (end == total)
+      break;
+    // Skip the zero ending the block, which is implied by the code. A full
+    // run does not end with a zero.
+    start = end - start < _PACKET_COBS_MAX_RUN ? end + 1 : end;
+  }
+
+  if (!ok || !_packet_send_byte(port, 0)) {
+    _packet_resync[port] = true;
+    return false;
+  }
+  return true;
+}
+
+bool packet_send(const uint8_t *payload, uint8_t len) {
+  return packet_port_send(USART_PORT0, payload, len);
+}
+
+#endif /* ifndef AVRO_PACKET_H */
@@ -0,0 +1,107 @@
+/******************************************************************************
+ * File:             power.h
+ *
+ * Author:           Ole Martin Ruud
+ * Created:          10/14/26
+ * Description:      Sleeping while waiting for interrupts, in the deepest
+ *                   mode the running peripherals allow.
+ *****************************************************************************/
+
+#ifndef AVRO_POWER_H
+#define AVRO_POWER_H
+
+#include <stdint.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+#include <util/twi.h>
+
+// PUBLIC
+
+// Sleeps in idle mode while cond is true, checking it again after every
+// interrupt, so cond should be something which an interrupt makes false. NB!
+// cond is checked with interrupts disabled, so an interrupt can not make it
+// false just before sleeping, which would then sleep until the next one.
+// When called with interrupts disabled, it spins instead of sleeping, as
+// nothing could wake it.
+#define POWER_IDLE_WHILE(cond) _POWER_SLEEP_WHILE(SLEEP_MODE_IDLE, cond)
+
+// The same as above, but in the deepest mode which keeps the running
+// peripherals going, see power_deepest_sleep_mode. NB! In power-down, only
+// external interrupts, pin changes, a TWI address match and the watchdog
+// wake the CPU, so something has to be set up to do so.
+#define POWER_SLEEP_WHILE(cond)                                                \
+  _POWER_SLEEP_WHILE(power_deepest_sleep_mode(), cond)
+
+// Returns the deepest sleep mode which does not stop anything running:
+//  - idle while a timer is clocked (e.g. Timer4 stepping, Timer5 multiplexing
+//    the segments), a USART is enabled, the TWI is in a transfer, the ADC is
+//    converting or INT4 to INT7 are enabled on an edge,
+//  - power-save while only an asynchronous Timer2 runs,
+//  - and power-down otherwise.
+uint8_t power_deepest_sleep_mode();
+
+// PRIVATE
+
+#define _POWER_SLEEP_WHILE(mode, cond)                                         \
+  do {                                                                         \
+    uint8_t _power_sreg = SREG;                                                \
+    cli();                                                                     \
+    while (cond) {                                                             \
+      if (!(_power_sreg & (1 << SREG_I)))                                      \
+        continue;                                                              \
+      set_sleep_mode(mode);                                                    \
+      sleep_enable();                                                          \
+      /* NB! sei() takes effect after the next instruction, so the CPU */      \
+      /* sleeps before any pending interrupt wakes it. */                      \
+      sei();                                                                   \
+      sleep_cpu();                                                             \
+      sleep_disable();                                                         \
+      cli();                                                                   \
+    }                                                                          \
+    SREG = _power_sreg;                                                        \
+  } while (0)
+
+#define _POWER_CLOCK_SELECT 0x07
+
+uint8_t power_deepest_sleep_mode() {
+  if ((TCCR0B | TCCR1B) & _POWER_CLOCK_SELECT)
+    return SLEEP_MODE_IDLE;
+#ifdef TCCR3B
+  if ((TCCR3B | TCCR4B | TCCR5B) & _POWER_CLOCK_SELECT)
+    return SLEEP_MODE_IDLE;
+#endif
+
+  uint8_t usarts = UCSR0B;
+#ifdef UCSR1B
+  usarts |= UCSR1B;
+#endif
+#ifdef UCSR2B
+  usarts |= UCSR2B | UCSR3B;
+#endif
+  if (usarts & ((1 << RXEN0) | (1 << TXEN0)))
+    return SLEEP_MODE_IDLE;
+
+  // The TWI is idle, or only listening for its address, when there is no
+  // status and neither a START nor a STOP is waiting to be sent
+  if ((TWCR & (1 << TWEN)) &&
+      (TW_STATUS != TW_NO_INFO || (TWCR & ((1 << TWSTA) | (1 << TWSTO)))))
+    return SLEEP_MODE_IDLE;
+
+  if (ADCSRA & (1 << ADSC))
+    return SLEEP_MODE_IDLE;
+
+  // NB! INT4 to INT7 only see edges with the I/O clock running, while INT0 to
+  // INT3 wake from any mode
+  for (uint8_t i = 0; i < 4; ++i)
+    if ((EIMSK & (1 << (INT4 + i))) && ((EICRB >> (2 * i)) & 0x03))
+      return SLEEP_MODE_IDLE;
+
+  if (TCCR2B & _POWER_CLOCK_SELECT)
+    return (ASSR & (1 << AS2)) ? SLEEP_MODE_PWR_SAVE : SLEEP_MODE_IDLE;
+
+  return SLEEP_MODE_PWR_DOWN;
+}
+
+#endif /* ifndef AVRO_POWER_H */
@@ -0,0 +1,180 @@
+/******************************************************************************
+ * File:             profile.h
+ *
+ * Author:           Ole Martin Ruud
+ * Created:          10/14/26
+ * Description:      Opt-in profiling of the interrupts of the library. NB!
+ *                   Uses TIMER1 and DEBUG_PORT when AVRO_PROFILE is defined.
+ *****************************************************************************/
+
+#ifndef AVRO_PROFILE_H
+#define AVRO_PROFILE_H
+
+#include <stdint.h>
+
+#include <avr/io.h>
+
+#ifdef AVRO_PROFILE
+#include <stdio.h>
+
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#endif
+
+#include "common.h"
+
+// Define AVRO_PROFILE to measure the interrupts, where every interrupt of the
+// library then sets its pin of DEBUG_PORT while it runs, so a logic analyzer
+// shows when and for how long it runs, and counts its cycles with Timer1.
+// Everything compiles out without it, or when AVRO_DISABLE_DEBUG is defined.
+//
+// NB! The cycles are counted from the first to the last statement of the
+// interrupt, so they do not include the 4 cycles of latency, nor the register
+// saving and restoring of the compiler, which can be seen on the pins. Also,
+// DEBUG_PORT is the port of the keypad by default.
+#if defined(AVRO_PROFILE) && defined(AVRO_DISABLE_DEBUG)
+#undef AVRO_PROFILE
+#endif
+
+// Claim the hardware, see system.h
+#ifdef AVRO_PROFILE
+#ifdef AVRO_USES_TIMER1
+#error "profile.h: TIMER1 is already in use"
+#endif
+#define AVRO_USES_TIMER1
+#ifndef DEBUG_CUSTOM_PORT
+#ifdef AVRO_USES_PORTK
+#error "profile.h: PORTK is already in use"
+#endif
+#define AVRO_USES_PORTK
+#endif
+#endif
+
+// PUBLIC
+
+// The interrupts being profiled, which are also the bits of DEBUG_PORT
+// showing them.
+typedef enum {
+  PROFILE_USART_RX,
+  PROFILE_USART_UDRE,
+  PROFILE_TWI,
+  PROFILE_STEPPER,
+  PROFILE_SEGMENT,
+  PROFILE_ROTARY,
+  PROFILE_LCD,
+  PROFILE_INPUT,
+  PROFILE_NUM_ISRS,
+} profile_isr_t;
+
+typedef struct {
+  uint32_t count;
+  uint32_t total;
+  uint16_t min;
+  uint16_t max;
+} profile_stats_t;
+
+// Starts Timer1 counting every cycle, and sets DEBUG_PORT as output.
+void init_profile();
+// Clears the stats of every interrupt.
+void profile_reset();
+// Copies the stats of the interrupt.
+void profile_read(profile_isr_t isr, profile_stats_t *stats);
+// Writes the stats of every interrupt as lines of text, e.g. over USART with
+// profile_dump(usart_send_string).
+void profile_dump(uint16_t (*write)(const char *str));
+
+// Marks the start and end of an interrupt, and must be used as the first and
+// last statement of it.
+#ifdef AVRO_PROFILE
+#define PROFILE_ISR_ENTER(isr) uint16_t _profile_start = _profile_enter(isr)
+#define PROFILE_ISR_EXIT(isr) _profile_exit(isr, _profile_start)
+#else
+#define PROFILE_ISR_ENTER(isr)
+#define PROFILE_ISR_EXIT(isr)
+#endif
+
+// PRIVATE
+
+_Static_assert(PROFILE_NUM_ISRS <= 8, "Every interrupt needs a debug pin");
+
+#ifdef AVRO_PROFILE
+const char _PROFILE_NAMES[PROFILE_NUM_ISRS][11] PROGMEM = {
+    "usart rx", "usart udre", "twi",  "stepper",
+    "segment",  "rotary",     "lcd",  "input",
+};
+
+profile_stats_t _profile_stats[PROFILE_NUM_ISRS];
+
+void init_profile() {
+  init_debug();
+  DEBUG_PORT = 0;
+
+  // Normal mode without prescaling, so the counter wraps every 65536 cycles
+  TCCR1A = 0;
+  TCCR1B = (1 << CS10);
+
+  profile_reset();
+}
+
+void profile_reset() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    for (uint8_t i = 0; i < PROFILE_NUM_ISRS; ++i) {
+      _profile_stats[i].count = 0;
+      _profile_stats[i].total = 0;
+      _profile_stats[i].min = UINT16_MAX;
+      _profile_stats[i].max = 0;
+    }
+  }
+}
+
+void profile_read(profile_isr_t isr, profile_stats_t *stats) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { *stats = _profile_stats[isr]; }
+}
+
+void profile_dump(uint16_t (*write)(const char *str)) {
+  char name[sizeof(_PROFILE_NAMES[0])];
+  char line[64];
+  for (uint8_t i = 0; i < PROFILE_NUM_ISRS; ++i) {
+    profile_stats_t stats;
+    profile_read(i, &stats);
+    if (stats.count == 0)
+      continue;
+    strcpy_P(name, _PROFILE_NAMES[i]);
+    snprintf_P(line, sizeof(line),
+               PSTR("%-10s n=%lu min=%u max=%u avg=%lu\r\n"), name,
+               (unsigned long)stats.count, stats.min, stats.max,
+               (unsigned long)(stats.total / stats.count));
+    write(line);
+  }
+}
+
+static inline uint16_t _profile_enter(profile_isr_t isr) {
+  DEBUG_PORT |= (1 << isr);
+  return TCNT1;
+}
+
+static inline void _profile_exit(profile_isr_t isr, uint16_t start) {
+  // NB! Interrupts do not nest, so the stats are safe to update here
+  uint16_t cycles = TCNT1 - start;
+  DEBUG_PORT &= ~(1 << isr);
+
+  profile_stats_t *stats = &_profile_stats[isr];
+  stats->count++;
+  stats->total += cycles;
+  if (cycles < stats->min)
+    stats->min = cycles;
+  if (cycles > stats->max)
+    stats->max = cycles;
+}
+#else
+// Nothing is measured, so nothing is kept either
+void init_profile() {}
+void profile_reset() {}
+void profile_read(profile_isr_t isr, profile_stats_t *stats) {
+  (void)isr;
+  *stats = (profile_stats_t){0};
+}
+void profile_dump(uint16_t (*write)(const char *str)) { (void)write; }
+#endif
+
+#endif /* ifndef AVRO_PROFILE_H */
@@ -4,7 +4,7 @@
  * Author:           Ole Martin Ruud
  * Created:          02/07/21
  * Description:      A simple interface to the rotary encoder using interrupts.
- *                   NB! Uses INT2 and INT4.
+ *                   NB! Uses INT2, INT3 and INT4.
  *****************************************************************************/
 
 #ifndef AVRO_ROTARY_H
@@ -13,13 +13,16 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <stdbool.h>
+#include <util/atomic.h>
+
+#include "profile.h"
 
 #ifndef ROTARY_CUSTOM_PORT
 #define ROTARY_DDR DDRD
 #define ROTARY_PORT PORTD
 #define ROTARY_PIN PIND
 
-// NB! Must be pin with INT2 interrupt
+// NB! Must be pins with INT2 and INT3 interrupts
 #define ROTARY_PIN_A PD2
 #define ROTARY_PIN_B PD3
 
@@ -31,60 +34,143 @@
 #define ROTARY2_PIN_BTN PE4
 #endif
 
+// Claim the hardware, see system.h
+#ifdef AVRO_USES_INT2
+#error "rotary.h: INT2 is already in use"
+#endif
+#define AVRO_USES_INT2
+#ifdef AVRO_USES_INT3
+#error "rotary.h: INT3 is already in use"
+#endif
+#define AVRO_USES_INT3
+#ifdef AVRO_USES_INT4
+#error "rotary.h: INT4 is already in use"
+#endif
+#define AVRO_USES_INT4
+
 // PUBLIC
 
+// Every edge on either channel is counted, giving 4 counts for each cycle of
+// the encoder.
 void init_rotary();
+// Returns the counts since the last read, saturated to the range of int8_t.
 int8_t rotary_read_offset();
+// Returns the counts since start, wrapping around at the range of int16_t.
+int16_t rotary_read_position();
 bool rotary_read_pressed();
 
+// Estimates the velocity from the counts since the last update, which is to be
+// called regularly with the milliseconds passed since the last call.
+void rotary_update_velocity(uint16_t elapsed_ms);
+// Returns the smoothed velocity in counts per second.
+int16_t rotary_read_velocity();
+
 // PRIVATE
 
+// Counts for each transition from the previous (upper two bits) to the new
+// state (lower two bits) of A and B. Going back and forth between two states
+// is a turn back, while both channels changing at once means an edge was
+// missed or bounced, which is rejected as no movement.
+const int8_t _ROTARY_TRANSITIONS[16] = {
+    0, -1, 1, 0, // from 00
+    1, 0, 0, -1, // from 01
+    -1, 0, 0, 1, // from 10
+    0, 1, -1, 0, // from 11
+};
+
 volatile int8_t _rotary_offset;
+volatile int16_t _rotary_position;
 volatile bool _rotary_pressed;
+uint8_t _rotary_state;
+
+int16_t _rotary_last_position;
+// Smoothed velocity scaled by 4, so it does not get stuck a few counts off
+// by truncating the average.
+int32_t _rotary_velocity4;
+
+static inline uint8_t _rotary_read_state() {
+  uint8_t pins = ROTARY_PIN;
+  return (((pins >> ROTARY_PIN_A) & 1) << 1) | ((pins >> ROTARY_PIN_B) & 1);
+}
 
 void init_rotary() {
   // Ensure rotary pins are inputs
   ROTARY_DDR &= ~(1 << ROTARY_PIN_A) & ~(1 << ROTARY_PIN_B);
   ROTARY2_DDR &= ~(1 << ROTARY2_PIN_BTN);
 
-  // Enable any edge interrupt for int2
-  EICRA |= (1 << ISC20);
+  _rotary_state = _rotary_read_state();
+
+  // Enable any edge interrupt for int2 and int3
+  EICRA |= (1 << ISC20) | (1 << ISC30);
 
   // Enable falling edge interrupt for int4
   EICRB |= (1 << ISC41);
 
-  // Enable both INT2 and INT4
-  EIMSK |= (1 << INT2) | (1 << INT4);
+  // Enable INT2, INT3 and INT4
+  EIMSK |= (1 << INT2) | (1 << INT3) | (1 << INT4);
 }
 
 int8_t rotary_read_offset() {
-  int8_t tmp = _rotary_offset;
-  _rotary_offset = 0;
+  int8_t tmp;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    tmp = _rotary_offset;
+    _rotary_offset = 0;
+  }
   return tmp;
 }
 
+int16_t rotary_read_position() {
+  int16_t tmp;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { tmp = _rotary_position; }
+  return tmp;
+}
+
+void rotary_update_velocity(uint16_t elapsed_ms) {
+  if (elapsed_ms == 0)
+    return;
+
+  int16_t position = rotary_read_position();
+  int16_t counts = position - _rotary_last_position;
+  _rotary_last_position = position;
+
+  // Smooth with an exponential moving average, giving each sample 1/4 weight
+  int32_t velocity = (int32_t)counts * 1000 / elapsed_ms;
+  if (velocity > INT16_MAX)
+    velocity = INT16_MAX;
+  if (velocity < INT16_MIN)
+    velocity = INT16_MIN;
+  _rotary_velocity4 += velocity - _rotary_velocity4 / 4;
+}
+
+int16_t rotary_read_velocity() { return _rotary_velocity4 / 4; }
+
 bool rotary_read_pressed() {
   bool tmp = _rotary_pressed;
   _rotary_pressed = false;
   return tmp;
 }
 
-ISR(INT4_vect) { _rotary_pressed = true; }
+ISR(INT4_vect) {
+  PROFILE_ISR_ENTER(PROFILE_ROTARY);
+  _rotary_pressed = true;
+  PROFILE_ISR_EXIT(PROFILE_ROTARY);
+}
 
 ISR(INT2_vect) {
+  PROFILE_ISR_ENTER(PROFILE_ROTARY);
   // See https://www.best-microcontroller-projects.com/rotary-encoder.html
-  bool a = (ROTARY_PIN & (1 << ROTARY_PIN_A)) != 0;
-  bool b = (ROTARY_PIN & (1 << ROTARY_PIN_B)) != 0;
-
-  if (a != b) {
-    // CW
-    if (_rotary_offset < INT8_MAX)
-      _rotary_offset++;
-  } else {
-    // CCW
-    if (_rotary_offset > INT8_MIN)
-      _rotary_offset--;
-  }
+  uint8_t state = _rotary_read_state();
+  int8_t delta = _ROTARY_TRANSITIONS[(_rotary_state << 2) | state];
+  _rotary_state = state;
+
+  _rotary_position += delta;
+  int8_t offset = _rotary_offset;
+  if ((delta > 0 && offset < INT8_MAX) || (delta < 0 && offset > INT8_MIN))
+    _rotary_offset = offset + delta;
+  PROFILE_ISR_EXIT(PROFILE_ROTARY);
 }
 
+// Both channels are decoded the same way
+ISR(INT3_vect, ISR_ALIASOF(INT2_vect));
+
 #endif /* ifndef AVRO_ROTARY_H */
@@ -12,10 +12,14 @@
 
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <stdbool.h>
 
 #include <util/atomic.h>
 #include <util/delay.h>
 
+#include "profile.h"
+
 #ifndef SEGMENT_CUSTOM_PORT
 #define SEGMENT_DDR DDRA
 #define SEGMENT_PORT PORTA
@@ -27,6 +31,22 @@
 #define SEGMENT_DIGIT_PIN PINC
 #endif
 
+// Claim the hardware, see system.h
+#ifdef AVRO_USES_TIMER5
+#error "segment.h: TIMER5 is already in use"
+#endif
+#define AVRO_USES_TIMER5
+#ifndef SEGMENT_CUSTOM_PORT
+#ifdef AVRO_USES_PORTA
+#error "segment.h: PORTA is already in use"
+#endif
+#define AVRO_USES_PORTA
+#ifdef AVRO_USES_PORTC_LOW
+#error "segment.h: PORTC_LOW is already in use"
+#endif
+#define AVRO_USES_PORTC_LOW
+#endif
+
 #ifndef SEGMENT_REFRESH_RATE
 #define SEGMENT_REFRESH_RATE 50
 #endif
@@ -34,42 +54,135 @@
 #define SEGMENT_NUM_CHARS 4
 #endif
 
+// Define to switch digits from a single compare A interrupt per digit instead
+// of turning each digit on and off with compare B and C. NB! Every digit is
+// then shown at full brightness, and segment_set_brightness only turns digits
+// on or off.
+// #define SEGMENT_SINGLE_INTERRUPT
+
+// Time every digit is blanked before the next is turned on in the single
+// interrupt mode, which keeps the previous digit from bleeding into it.
+#ifndef SEGMENT_BLANK_US
+#define SEGMENT_BLANK_US 2
+#endif
+
+// Brightness set by init_segment, where 128 lights every digit half the time.
+#ifndef SEGMENT_BRIGHTNESS
+#define SEGMENT_BRIGHTNESS 128
+#endif
+
 
 // PUBLIC
 
 void init_segment();
 void segment_clear();
+// Shifts the characters to the left and shows c as the rightmost. A '.' lights
+// the decimal point of the rightmost character instead.
 void segment_write_char(char c);
+// Writes every character of the string as by segment_write_char, but updates
+// the display only once.
+void segment_write_string(const char *str);
+// Shows the number right aligned, or dashes on every digit if it does not fit.
+void segment_write_number(int16_t number);
+// Turns the decimal point of the digit on or off, where digit 0 is the
+// rightmost.
+void segment_set_dot(uint8_t digit, bool on);
+// Sets how long every digit is lit, from 0 (off) to 255 (lit the whole time of
+// the digit). The default is SEGMENT_BRIGHTNESS.
+void segment_set_brightness(uint8_t brightness);
+// Sets the brightness of a single digit, where digit 0 is the rightmost.
+void segment_set_digit_brightness(uint8_t digit, uint8_t brightness);
 
 // PRIVATE
 
-// 0b10000000 = top
-// 0b01000000 = right top
-// 0b00100000 = right bottom
-// 0b00010000 = bottom
-// 0b00001000 = left bottom
-// 0b00000100 = left top
-// 0b00000010 = middle
-// 0b00000001 = dot
-
-const uint8_t SEGMENT_ENCODINGS_NUMBERS[] = {
-    0b11111100, // zero
-    0b01100000, // one
-    0b11011010, // two
-    0b11110010, // three
-    0b01100110, // four
-    0b10110110, // five
-    0b10111110, // six
-    0b11100000, // seven
-    0b11111110, // eight
-    0b11100110, // nine
-};
-
-const uint8_t SEGMENT_ENCODINGS_LETTERS[] = {
-    0b11101110, // a
-    0b00111110, // b
-    0b10011100, // c
-    0b01111010, // d
+// Bits of each segment on SEGMENT_PORT, named as usual clockwise from the top
+// with g as the middle.
+#define _SEG_A 0x80 // top
+#define _SEG_B 0x40 // right top
+#define _SEG_C 0x20 // right bottom
+#define _SEG_D 0x10 // bottom
+#define _SEG_E 0x08 // left bottom
+#define _SEG_F 0x04 // left top
+#define _SEG_G 0x02 // middle
+#define _SEG_DOT 0x01
+
+// Segments of every 7-bit ASCII character, kept in flash and indexed directly.
+// Characters which cannot be shown are left blank.
+const uint8_t SEGMENT_FONT[128] PROGMEM = {
+    ['"'] = _SEG_B | _SEG_F,
+    ['\''] = _SEG_F,
+    ['('] = _SEG_A | _SEG_D | _SEG_E | _SEG_F,
+    [')'] = _SEG_A | _SEG_B | _SEG_C | _SEG_D,
+    ['-'] = _SEG_G,
+    ['0'] = _SEG_A | _SEG_B | _SEG_C | _SEG_D | _SEG_E | _SEG_F,
+    ['1'] = _SEG_B | _SEG_C,
+    ['2'] = _SEG_A | _SEG_B | _SEG_D | _SEG_E | _SEG_G,
+    ['3'] = _SEG_A | _SEG_B | _SEG_C | _SEG_D | _SEG_G,
+    ['4'] = _SEG_B | _SEG_C | _SEG_F | _SEG_G,
+    ['5'] = _SEG_A | _SEG_C | _SEG_D | _SEG_F | _SEG_G,
+    ['6'] = _SEG_A | _SEG_C | _SEG_D | _SEG_E | _SEG_F | _SEG_G,
+    ['7'] = _SEG_A | _SEG_B | _SEG_C,
+    ['8'] = _SEG_A | _SEG_B | _SEG_C | _SEG_D | _SEG_E | _SEG_F | _SEG_G,
+    ['9'] = _SEG_A | _SEG_B | _SEG_C | _SEG_D | _SEG_F | _SEG_G,
+    ['='] = _SEG_D | _SEG_G,
+    ['?'] = _SEG_A | _SEG_B | _SEG_E | _SEG_G,
+    ['A'] = _SEG_A | _SEG_B | _SEG_C | _SEG_E | _SEG_F | _SEG_G,
+    ['B'] = _SEG_C | _SEG_D | _SEG_E | _SEG_F | _SEG_G,
+    ['C'] = _SEG_A | _SEG_D | _SEG_E | _SEG_F,
+    ['D'] = _SEG_B | _SEG_C | _SEG_D | _SEG_E | _SEG_G,
+    ['E'] = _SEG_A | _SEG_D | _SEG_E | _SEG_F | _SEG_G,
+    ['F'] = _SEG_A | _SEG_E | _SEG_F | _SEG_G,
+    ['G'] = _SEG_A | _SEG_C | _SEG_D | _SEG_E | _SEG_F,
+    ['H'] = _SEG_B | _SEG_C | _SEG_E | _SEG_F | _SEG_G,
+    ['I'] = _SEG_E | _SEG_F,
+    ['J'] = _SEG_B | _SEG_C | _SEG_D | _SEG_E,
+    ['K'] = _SEG_A | _SEG_C | _SEG_E | _SEG_F | _SEG_G,
+    ['L'] = _SEG_D | _SEG_E | _SEG_F,
+    ['M'] = _SEG_A | _SEG_C | _SEG_E | _SEG_G,
+    ['N'] = _SEG_C | _SEG_E | _SEG_G,
+    ['O'] = _SEG_A | _SEG_B | _SEG_C | _SEG_D | _SEG_E | _SEG_F,
+    ['P'] = _SEG_A | _SEG_B | _SEG_E | _SEG_F | _SEG_G,
+    ['Q'] = _SEG_A | _SEG_B | _SEG_C | _SEG_F | _SEG_G,
+    ['R'] = _SEG_E | _SEG_G,
+    ['S'] = _SEG_A | _SEG_C | _SEG_D | _SEG_F | _SEG_G,
+    ['T'] = _SEG_D | _SEG_E | _SEG_F | _SEG_G,
+    ['U'] = _SEG_B | _SEG_C | _SEG_D | _SEG_E | _SEG_F,
+    ['V'] = _SEG_C | _SEG_D | _SEG_E,
+    ['W'] = _SEG_B | _SEG_D | _SEG_F | _SEG_G,
+    ['X'] = _SEG_B | _SEG_C | _SEG_E | _SEG_F | _SEG_G,
+    ['Y'] = _SEG_B | _SEG_C | _SEG_D | _SEG_F | _SEG_G,
+    ['Z'] = _SEG_A | _SEG_B | _SEG_D | _SEG_E | _SEG_G,
+    ['['] = _SEG_A | _SEG_D | _SEG_E | _SEG_F,
+    [']'] = _SEG_A | _SEG_B | _SEG_C | _SEG_D,
+    ['^'] = _SEG_A | _SEG_B | _SEG_F,
+    ['_'] = _SEG_D,
+    ['a'] = _SEG_A | _SEG_B | _SEG_C | _SEG_E | _SEG_F | _SEG_G,
+    ['b'] = _SEG_C | _SEG_D | _SEG_E | _SEG_F | _SEG_G,
+    ['c'] = _SEG_A | _SEG_D | _SEG_E | _SEG_F,
+    ['d'] = _SEG_B | _SEG_C | _SEG_D | _SEG_E | _SEG_G,
+    ['e'] = _SEG_A | _SEG_D | _SEG_E | _SEG_F | _SEG_G,
+    ['f'] = _SEG_A | _SEG_E | _SEG_F | _SEG_G,
+    ['g'] = _SEG_A | _SEG_C | _SEG_D | _SEG_E | _SEG_F,
+    ['h'] = _SEG_C | _SEG_E | _SEG_F | _SEG_G,
+    ['i'] = _SEG_E,
+    ['j'] = _SEG_B | _SEG_C | _SEG_D | _SEG_E,
+    ['k'] = _SEG_A | _SEG_C | _SEG_E | _SEG_F | _SEG_G,
+    ['l'] = _SEG_D | _SEG_E | _SEG_F,
+    ['m'] = _SEG_A | _SEG_C | _SEG_E | _SEG_G,
+    ['n'] = _SEG_C | _SEG_E | _SEG_G,
+    ['o'] = _SEG_C | _SEG_D | _SEG_E | _SEG_G,
+    ['p'] = _SEG_A | _SEG_B | _SEG_E | _SEG_F | _SEG_G,
+    ['q'] = _SEG_A | _SEG_B | _SEG_C | _SEG_F | _SEG_G,
+    ['r'] = _SEG_E | _SEG_G,
+    ['s'] = _SEG_A | _SEG_C | _SEG_D | _SEG_F | _SEG_G,
+    ['t'] = _SEG_D | _SEG_E | _SEG_F | _SEG_G,
+    ['u'] = _SEG_C | _SEG_D | _SEG_E,
+    ['v'] = _SEG_C | _SEG_D | _SEG_E,
+    ['w'] = _SEG_B | _SEG_D | _SEG_F | _SEG_G,
+    ['x'] = _SEG_B | _SEG_C | _SEG_E | _SEG_F | _SEG_G,
+    ['y'] = _SEG_B | _SEG_C | _SEG_D | _SEG_F | _SEG_G,
+    ['z'] = _SEG_A | _SEG_B | _SEG_D | _SEG_E | _SEG_G,
+    ['|'] = _SEG_E | _SEG_F,
 };
 
 // Use two backing buffers to enable atomic pointer swaps as a synchronization
@@ -77,18 +190,21 @@ const uint8_t SEGMENT_ENCODINGS_LETTERS[] = {
 // hence CANNOT be written too. Further the main execution owns the
 // write-pointer (wdata) and can write to it, BUT it should never be read in an
 // interrupt.
-char _segment_buf_left[SEGMENT_NUM_CHARS] = {0};
-char _segment_buf_right[SEGMENT_NUM_CHARS] = {0};
+//
+// NB! The buffers hold the segments to light for each digit, encoded when
+// written, so the interrupt only has to copy them to SEGMENT_PORT.
+uint8_t _segment_buf_left[SEGMENT_NUM_CHARS] = {0};
+uint8_t _segment_buf_right[SEGMENT_NUM_CHARS] = {0};
 
-volatile char *_segment_wdata = _segment_buf_left;
-volatile char *_segment_rdata = _segment_buf_right;
+volatile uint8_t *_segment_wdata = _segment_buf_left;
+volatile uint8_t *_segment_rdata = _segment_buf_right;
 
 void _swap_data_ptrs() {
   // Swap the pointers atomically so that the read-pointer points to the
   // newly filled data, while the write-pointer will point to the outdated
   // (old) data.
   ATOMIC_BLOCK(ATOMIC_FORCEON) {
-    volatile char *tmp = _segment_wdata;
+    volatile uint8_t *tmp = _segment_wdata;
     _segment_wdata = _segment_rdata;
     _segment_rdata = tmp;
   }
@@ -101,6 +217,59 @@ void _swap_data_ptrs() {
   }
 }
 
+static inline uint8_t _segment_encode(char c) {
+  return pgm_read_byte(&SEGMENT_FONT[(uint8_t)c & 0x7f]);
+}
+
+// Timer5 ticks at F_CPU / 8, so a digit fits in 16 bits down to refresh rates
+// of F_CPU / (8 * 65536 * SEGMENT_NUM_CHARS).
+#define _SEGMENT_PRESCALER 8
+#define _SEGMENT_DIGIT_TICKS                                                   \
+  (F_CPU / (_SEGMENT_PRESCALER * SEGMENT_NUM_CHARS * SEGMENT_REFRESH_RATE))
+// NB! Rounded up to at least a tick, as it would be 0 at slow clocks.
+#define _SEGMENT_BLANK_TICKS_CEIL                                              \
+  ((F_CPU * SEGMENT_BLANK_US + 1000000UL * _SEGMENT_PRESCALER - 1) /           \
+   (1000000UL * _SEGMENT_PRESCALER))
+#define _SEGMENT_BLANK_TICKS                                                   \
+  ((uint16_t)(_SEGMENT_BLANK_TICKS_CEIL > 0 ? _SEGMENT_BLANK_TICKS_CEIL : 1))
+
+// Shortest time a digit is on or off, leaving room for the interrupts turning
+// it on and off.
+#define _SEGMENT_MIN_TICKS 16
+
+_Static_assert(_SEGMENT_DIGIT_TICKS <= 0xffff,
+               "SEGMENT_REFRESH_RATE is too low for Timer5");
+_Static_assert(_SEGMENT_DIGIT_TICKS > 2 * _SEGMENT_MIN_TICKS + 1,
+               "SEGMENT_REFRESH_RATE is too high for Timer5");
+
+// Brightness of every digit, and the value of OCR5C turning it off, indexed
+// from the rightmost digit as _segment_current_digit.
+uint8_t _segment_brightness[SEGMENT_NUM_CHARS];
+volatile uint16_t _segment_on_ticks[SEGMENT_NUM_CHARS];
+
+void segment_set_digit_brightness(uint8_t digit, uint8_t brightness) {
+  if (digit >= SEGMENT_NUM_CHARS)
+    return;
+
+  // Compare B turns the digit on at 0 and C off at the on-time, which must be
+  // within the period for C to fire at all.
+  uint32_t ticks = (uint32_t)_SEGMENT_DIGIT_TICKS * brightness / 255;
+  if (ticks < _SEGMENT_MIN_TICKS)
+    ticks = _SEGMENT_MIN_TICKS;
+  if (ticks > _SEGMENT_DIGIT_TICKS - _SEGMENT_MIN_TICKS)
+    ticks = _SEGMENT_DIGIT_TICKS - _SEGMENT_MIN_TICKS;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    _segment_brightness[digit] = brightness;
+    _segment_on_ticks[digit] = ticks;
+  }
+}
+
+void segment_set_brightness(uint8_t brightness) {
+  for (uint8_t i = 0; i < SEGMENT_NUM_CHARS; ++i)
+    segment_set_digit_brightness(i, brightness);
+}
+
 void init_segment() {
   SEGMENT_DDR = 0xff;
   SEGMENT_PORT = 0x00;
@@ -108,19 +277,27 @@ void init_segment() {
   SEGMENT_DIGIT_DDR = 0x0f;
   SEGMENT_DIGIT_PORT = 0x0f;
 
+  segment_set_brightness(SEGMENT_BRIGHTNESS);
+
   // Setup interval
+  OCR5A = _SEGMENT_DIGIT_TICKS - 1;
   OCR5B = 0x0000;
-  OCR5C = F_CPU / (2 * SEGMENT_NUM_CHARS * SEGMENT_REFRESH_RATE);
-  OCR5A = F_CPU / (SEGMENT_NUM_CHARS * SEGMENT_REFRESH_RATE);
+  OCR5C = _segment_on_ticks[0];
 
-  TCCR5B |=
-      // Select clock (no prescaling)
-      (1 << CS50) |
+  TCCR5A = 0;
+  TCCR5B =
+      // Select clock (prescale by 8)
+      (1 << CS51) |
       // Set CTC mode
       (1 << WGM52);
 
+#ifdef SEGMENT_SINGLE_INTERRUPT
+  // Enable compare A interrupt
+  TIMSK5 |= (1 << OCIE5A);
+#else
   // Enable compare B and C interrupt
   TIMSK5 |= (1 << OCIE5B) | (1 << OCIE5C);
+#endif
 }
 
 void segment_clear() {
@@ -130,33 +307,71 @@ void segment_clear() {
   _swap_data_ptrs();
 }
 
-void segment_write_char(char c) {
+// Adds the character to the write buffer without showing it.
+static inline void _segment_push_char(char c) {
+  if (c == '.') {
+    _segment_wdata[SEGMENT_NUM_CHARS - 1] |= _SEG_DOT;
+    return;
+  }
+
   // Shift data to the left and add new symbol at the end
   for (uint8_t i = 0; i < SEGMENT_NUM_CHARS - 1; ++i)
     _segment_wdata[i] = _segment_wdata[i + 1];
-  _segment_wdata[SEGMENT_NUM_CHARS - 1] = c;
+  _segment_wdata[SEGMENT_NUM_CHARS - 1] = _segment_encode(c);
+}
+
+void segment_write_char(char c) {
+  _segment_push_char(c);
   _swap_data_ptrs();
 }
 
-void _show_single_digit(uint8_t d) {
-  if (0 <= d && d <= 9)
-    SEGMENT_PORT = SEGMENT_ENCODINGS_NUMBERS[d];
+void segment_write_string(const char *str) {
+  while (*str)
+    _segment_push_char(*str++);
+  _swap_data_ptrs();
+}
+
+void segment_write_number(int16_t number) {
+  uint16_t value = number < 0 ? -(uint16_t)number : (uint16_t)number;
+
+  uint8_t i = SEGMENT_NUM_CHARS;
+  do {
+    _segment_wdata[--i] = _segment_encode('0' + value % 10);
+    value /= 10;
+  } while (value != 0 && i > 0);
+
+  bool fits = value == 0 && (number >= 0 || i > 0);
+  if (!fits) {
+    for (i = 0; i < SEGMENT_NUM_CHARS; ++i)
+      _segment_wdata[i] = _SEG_G;
+  } else {
+    if (number < 0)
+      _segment_wdata[--i] = _SEG_G;
+    while (i > 0)
+      _segment_wdata[--i] = 0;
+  }
+  _swap_data_ptrs();
+}
+
+void segment_set_dot(uint8_t digit, bool on) {
+  if (digit >= SEGMENT_NUM_CHARS)
+    return;
+  if (on)
+    _segment_wdata[SEGMENT_NUM_CHARS - 1 - digit] |= _SEG_DOT;
   else
-    SEGMENT_PORT = 0;
+    _segment_wdata[SEGMENT_NUM_CHARS - 1 - digit] &= ~_SEG_DOT;
+  _swap_data_ptrs();
+}
+
+void _show_single_digit(uint8_t d) {
+  SEGMENT_PORT = d <= 9 ? pgm_read_byte(&SEGMENT_FONT['0' + d]) : 0;
 }
 
 void _enable_digit(uint8_t n) { SEGMENT_DIGIT_PORT &= ~(1 << n); }
 
 void _disable_digit(uint8_t n) { SEGMENT_DIGIT_PORT |= (1 << n); }
 
-void _show_char(char c) {
-  if ('a' <= c && c <= 'd')
-    SEGMENT_PORT = SEGMENT_ENCODINGS_LETTERS[c - 'a'];
-  else if ('0' <= c && c <= '9')
-    SEGMENT_PORT = SEGMENT_ENCODINGS_NUMBERS[c - '0'];
-  else
-    SEGMENT_PORT = 0;
-}
+void _show_char(char c) { SEGMENT_PORT = _segment_encode(c); }
 
 void _show_data(char data[4]) {
   for (int i = 3; i >= 0; --i) {
@@ -170,20 +385,50 @@ void _show_data(char data[4]) {
 
 volatile uint8_t _segment_current_digit = 0;
 
+static inline void _segment_next_digit() {
+  if (_segment_current_digit < SEGMENT_NUM_CHARS - 1)
+    _segment_current_digit++;
+  else
+    _segment_current_digit = 0;
+}
+
+#ifdef SEGMENT_SINGLE_INTERRUPT
+ISR(TIMER5_COMPA_vect) {
+  PROFILE_ISR_ENTER(PROFILE_SEGMENT);
+  _disable_digit(_segment_current_digit);
+  _segment_next_digit();
+  uint8_t digit = _segment_current_digit;
+  SEGMENT_PORT = _segment_rdata[SEGMENT_NUM_CHARS - 1 - digit];
+
+  // The timer restarted from 0 at the compare match, so wait for it to count
+  // out the blanking gap before showing the next digit.
+  while (TCNT5 < _SEGMENT_BLANK_TICKS)
+    ;
+  if (_segment_brightness[digit] != 0)
+    _enable_digit(digit);
+  PROFILE_ISR_EXIT(PROFILE_SEGMENT);
+}
+#else
 ISR(TIMER5_COMPB_vect) {
-  _enable_digit(_segment_current_digit);
-  _show_char(_segment_rdata[SEGMENT_NUM_CHARS - 1 - _segment_current_digit]);
+  PROFILE_ISR_ENTER(PROFILE_SEGMENT);
+  uint8_t digit = _segment_current_digit;
+  // NB! OCR5C is not buffered in CTC mode, and is set here for this digit
+  // long before the timer reaches it.
+  OCR5C = _segment_on_ticks[digit];
+  if (_segment_brightness[digit] != 0)
+    _enable_digit(digit);
+  SEGMENT_PORT = _segment_rdata[SEGMENT_NUM_CHARS - 1 - digit];
+  PROFILE_ISR_EXIT(PROFILE_SEGMENT);
 }
 
 ISR(TIMER5_COMPC_vect) {
+  PROFILE_ISR_ENTER(PROFILE_SEGMENT);
   _disable_digit(_segment_current_digit);
   // This clears the digit bus to prevent digits bleeding into each other.
-  _show_char(' ');
-
-  if (0 <= _segment_current_digit && _segment_current_digit < SEGMENT_NUM_CHARS - 1)
-    _segment_current_digit++;
-  else
-    _segment_current_digit = 0;
+  SEGMENT_PORT = 0;
+  _segment_next_digit();
+  PROFILE_ISR_EXIT(PROFILE_SEGMENT);
 }
+#endif
 
 #endif /* ifndef AVRO_SEGMENT_H */
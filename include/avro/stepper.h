@@ -10,92 +10,506 @@
 #ifndef AVRO_STEPPER_H
 #define AVRO_STEPPER_H
 
+#include <assert.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 
+#include "circular_buffer.h"
+#include "profile.h"
+
 #ifndef STEPPER_CUSTOM_PORT
 #define STEPPER_DDR DDRC
 #define STEPPER_PORT PORTC
 #define STEPPER_PIN PINC
 #endif
 
+// Claim the hardware, see system.h
+#ifdef AVRO_USES_TIMER4
+#error "stepper.h: TIMER4 is already in use"
+#endif
+#define AVRO_USES_TIMER4
+#ifndef STEPPER_CUSTOM_PORT
+#ifdef AVRO_USES_PORTC_LOW
+#error "stepper.h: PORTC_LOW is already in use"
+#endif
+#define AVRO_USES_PORTC_LOW
+#endif
+
+// Default top speed in steps per second, and acceleration in steps per second
+// squared, of moves.
+#ifndef STEPPER_MAX_SPEED
+#define STEPPER_MAX_SPEED 1000
+#endif
+#ifndef STEPPER_ACCELERATION
+#define STEPPER_ACCELERATION 4000
+#endif
+
+// Amount of motors moved together. Axis 0 is on the lower 4 bits of
+// STEPPER_PORT, while the others have to be set up with init_stepper_axis.
+#ifndef STEPPER_NUM_AXES
+#define STEPPER_NUM_AXES 1
+#endif
+
+// Define to drive the coils in half-steps, doubling the resolution and
+// smoothing the motion. NB! Steps, speeds and accelerations are then counted
+// in half-steps.
+// #define STEPPER_HALF_STEP
+
+// Milliseconds the coils are kept energized after the last move before they
+// are released to save power, where 0 keeps them energized. NB! A released
+// motor may be turned by the load.
+#ifndef STEPPER_HOLD_MS
+#define STEPPER_HOLD_MS 0
+#endif
+
+// Bytes of the queue of moves, which must be a power of two of at most 128.
+// Each move takes 4 bytes per axis.
+#ifndef STEPPER_QUEUE_BYTES
+#define STEPPER_QUEUE_BYTES 64
+#endif
+
 // PUBLIC
 
 void init_stepper();
+// Drives axis with the 4 bits of the port starting at shift (0 or 4).
+void init_stepper_axis(uint8_t axis, volatile uint8_t *ddr,
+                       volatile uint8_t *port, uint8_t shift);
 void stepper_step_cw();
 void stepper_step_ccw();
 
+// Moves accelerate up to the max speed, cruise and decelerate to stop exactly
+// at the target. NB! The speed is limited to about 10000 steps per second and
+// does not go below about 30 steps per second.
+void stepper_set_max_speed(uint16_t steps_per_second);
+void stepper_set_acceleration(uint16_t steps_per_second2);
+
+// Moves axis 0 alone to the absolute position, or by the steps from where the
+// current move is headed. The target may be changed during a move, where the
+// motor decelerates before turning if the new target is behind it.
+// NB! These change the current move, so do not use them while there are
+// queued moves.
 void stepper_set_target(int32_t target);
 void stepper_move(int32_t steps);
+
+// Position of an axis in steps, counted by the interrupt as it steps.
+int32_t stepper_position();
+int32_t stepper_axis_position(uint8_t axis);
+// Sets the current position of axis 0, e.g. after homing it. NB! Only do this
+// when the motor does not move.
+void stepper_set_position(int32_t position);
+
+// Queues a move of every axis by the given steps, where the axes are stepped
+// together so they all arrive at the same time. The move starts right after
+// the previous one, and its speed is ramped along the axis moving the most.
+// Returns false if the queue is full.
+bool stepper_queue_move(const int32_t steps[STEPPER_NUM_AXES]);
+// Returns if the queue has room for another move.
+bool stepper_queue_ready();
+
+// Returns if all moves are done.
 bool stepper_done();
+// Stops immediately, without decelerating, and drops the queued moves.
 void stepper_stop();
+// De-energizes the coils of every axis until the next move.
+void stepper_release();
 
 // PRIVATE
 
+#ifdef STEPPER_HALF_STEP
+const uint8_t _stepper_states[] = {
+    0b0011, 0b0010, 0b0110, 0b0100, 0b1100, 0b1000, 0b1001, 0b0001,
+};
+#else
 const uint8_t _stepper_states[] = {
     0b0011,
     0b0110,
     0b1100,
     0b1001,
 };
+#endif
+
+// NB! The amount of states must be a power of two, so the index wraps by
+// masking.
+#define _STEPPER_NUM_STATES sizeof(_stepper_states)
+_Static_assert((_STEPPER_NUM_STATES & (_STEPPER_NUM_STATES - 1)) == 0,
+               "Number of stepper states must be a power of two");
 
+typedef struct {
+  volatile uint8_t *port;
+  uint8_t shift;
+  uint8_t index;
+  int32_t position;
+} _stepper_axis_t;
+
+_stepper_axis_t _stepper_axes[STEPPER_NUM_AXES];
+
+typedef struct {
+  int32_t steps[STEPPER_NUM_AXES];
+} _stepper_move_t;
+
+CIRCULAR_BUFFER_DEFINE(_stepper_queue, uint8_t, STEPPER_QUEUE_BYTES)
+_Static_assert(sizeof(_stepper_move_t) <= STEPPER_QUEUE_BYTES,
+               "STEPPER_QUEUE_BYTES cannot hold a single move");
+
+_stepper_queue_t _stepper_queue = {0};
+
+// Steps left of the current move along the axis moving the most.
+// NB! Changed by the interrupt for every step, so any access from outside it
+// has to mask interrupts, as 32 bits take several instructions on AVR.
 volatile int32_t _stepper_offset = 0;
-uint8_t _stepper_index = 0;
+
+// The current move as Bresenham's line algorithm, where each axis gets its
+// share (delta) of the steps of the longest axis (major), accumulating the
+// error until it has to take a step.
+uint32_t _stepper_major = 1;
+bool _stepper_single = false;
+uint32_t _stepper_delta[STEPPER_NUM_AXES];
+int32_t _stepper_error[STEPPER_NUM_AXES];
+int8_t _stepper_sign[STEPPER_NUM_AXES];
+
+// Timer4 ticks at F_CPU / 8. The step interval is kept in ticks as 24.8 fixed
+// point, and limited to what fits in OCR4A and the time the interrupt takes.
+#define _STEPPER_TIMER_HZ (F_CPU / 8)
+#define _STEPPER_MIN_TICKS 200
+#define _STEPPER_MAX_INTERVAL ((uint32_t)0xffff << 8)
+#define _STEPPER_HOLD_TICKS                                                    \
+  ((uint32_t)_STEPPER_TIMER_HZ / 1000 * STEPPER_HOLD_MS)
+
+// Interval of the first step from standstill, and of steps at max speed
+uint32_t _stepper_c0;
+uint32_t _stepper_cmin;
+
+// Direction of the current move (0 when standing still), the step of the
+// speed ramp, which is negative while decelerating, and the current interval.
+// NB! Only written by the interrupt while moving.
+volatile int8_t _stepper_dir = 0;
+int32_t _stepper_n = 0;
+uint32_t _stepper_c;
+
+void stepper_set_max_speed(uint16_t steps_per_second) {
+  uint32_t c = steps_per_second ? ((uint32_t)_STEPPER_TIMER_HZ << 8) /
+                                      steps_per_second
+                                : _STEPPER_MAX_INTERVAL;
+  if (c < (uint32_t)_STEPPER_MIN_TICKS << 8)
+    c = (uint32_t)_STEPPER_MIN_TICKS << 8;
+  if (c > _STEPPER_MAX_INTERVAL)
+    c = _STEPPER_MAX_INTERVAL;
+  // NB! Read by the step interrupt, so it must not see half of it
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { _stepper_cmin = c; }
+}
+
+// Integer square root, rounded down, a bit at a time.
+static inline uint16_t _stepper_isqrt(uint32_t x) {
+  uint32_t root = 0;
+  for (uint32_t bit = (uint32_t)1 << 30; bit != 0; bit >>= 2) {
+    if (x >= root + bit) {
+      x -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+  }
+  return root;
+}
+
+// The first interval is 0.676 * f * 256 * sqrt(2 / a) in 24.8 fixed point,
+// where sqrt(2 / a) is isqrt(2^31 / a) / 2^15, and 0.676 * 256 is about 173.
+#define _STEPPER_C0_SCALE                                                      \
+  (((uint32_t)_STEPPER_TIMER_HZ * 173 + (1UL << 14)) >> 15)
+
+void stepper_set_acceleration(uint16_t steps_per_second2) {
+  // The first interval as by David Austin, "Generate stepper-motor speed
+  // profiles in real time", where 0.676 corrects the error of the
+  // approximation used for the following steps. NB! Computed with integers
+  // only, as floating point would pull in a few KB of soft-float.
+  uint32_t c = _STEPPER_MAX_INTERVAL;
+  if (steps_per_second2) {
+    uint32_t c0 = _STEPPER_C0_SCALE *
+                  _stepper_isqrt(((uint32_t)1 << 31) / steps_per_second2);
+    if (c0 < c)
+      c = c0;
+  }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { _stepper_c0 = c; }
+}
+
+// Sets the coils of the axis as by its current state.
+static inline void _stepper_axis_output(_stepper_axis_t *axis) {
+  *axis->port = (*axis->port & ~(0x0f << axis->shift)) |
+                (_stepper_states[axis->index] << axis->shift);
+}
+
+void init_stepper_axis(uint8_t axis, volatile uint8_t *ddr,
+                       volatile uint8_t *port, uint8_t shift) {
+  assert(axis < STEPPER_NUM_AXES && shift <= 4);
+  _stepper_axis_t *a = &_stepper_axes[axis];
+  a->port = port;
+  a->shift = shift;
+  a->index = 0;
+  a->position = 0;
+
+  *ddr |= 0x0f << shift;
+  _stepper_axis_output(a);
+}
 
 void init_stepper() {
-  STEPPER_DDR |= 0x0f;
-  STEPPER_PORT = _stepper_states[_stepper_index];
+  init_stepper_axis(0, &STEPPER_DDR, &STEPPER_PORT, 0);
 
-  // Setup interval (2 ms)
-  OCR4A = F_CPU / 500;
+  stepper_set_max_speed(STEPPER_MAX_SPEED);
+  stepper_set_acceleration(STEPPER_ACCELERATION);
 
-  // Set CTC mode
-  TCCR4B |= (1 << WGM42);
+  // Set CTC mode, with the clock stopped until a move starts. NB! Every bit is
+  // assigned, so nothing set up by others is assumed.
+  TCCR4A = 0;
+  TCCR4B = (1 << WGM42);
 
   // Enable compare A interrupt
   TIMSK4 |= (1 << OCIE4A);
 }
 
-void stepper_stop() { _stepper_offset = 0; }
+void stepper_release() {
+  for (uint8_t i = 0; i < STEPPER_NUM_AXES; ++i)
+    *_stepper_axes[i].port &= ~(0x0f << _stepper_axes[i].shift);
+}
 
-void stepper_set_target(int32_t target) {
-  _stepper_offset = target;
+void stepper_stop() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    TCCR4B &= ~(1 << CS41);
+    _stepper_offset = 0;
+    _stepper_dir = 0;
+    _stepper_n = 0;
+  }
+  _stepper_queue_advance(STEPPER_QUEUE_BYTES, &_stepper_queue);
+}
+
+// Starts the timer unless a move is under way, where the interrupt then sets
+// out on the current move, or takes the next one from the queue.
+static inline void _stepper_start() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (_stepper_dir == 0) {
+      // The coils may have been released, or the timer may be counting the
+      // hold time, so energize them and step right away.
+      for (uint8_t i = 0; i < STEPPER_NUM_AXES; ++i)
+        _stepper_axis_output(&_stepper_axes[i]);
+      TCNT4 = 0;
+      OCR4A = _STEPPER_MIN_TICKS;
+      // Start counter with clock (prescale by 8)
+      TCCR4B |= (1 << CS41);
+    }
+  }
+}
+
+// Makes the current move one of axis 0 alone, unless it already is.
+static inline void _stepper_single_axis() {
+  if (_stepper_single)
+    return;
+  _stepper_single = true;
+  _stepper_major = 1;
+  for (uint8_t i = 0; i < STEPPER_NUM_AXES; ++i) {
+    _stepper_delta[i] = i == 0;
+    _stepper_error[i] = 0;
+    _stepper_sign[i] = 1;
+  }
+}
 
-  TCCR4B |= (1 << CS40);
+void stepper_set_target(int32_t target) {
+  _stepper_single_axis();
+  // NB! The position and offset change together in the interrupt, so the
+  // interrupt must not run between reading one and writing the other.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    _stepper_offset = target - _stepper_axes[0].position;
+  }
+  _stepper_start();
 }
 
 void stepper_move(int32_t steps) {
-  _stepper_offset += steps;
+  _stepper_single_axis();
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { _stepper_offset += steps; }
+  _stepper_start();
+}
+
+int32_t stepper_axis_position(uint8_t axis) {
+  assert(axis < STEPPER_NUM_AXES);
+  int32_t position;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { position = _stepper_axes[axis].position; }
+  return position;
+}
+
+int32_t stepper_position() { return stepper_axis_position(0); }
+
+void stepper_set_position(int32_t position) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { _stepper_axes[0].position = position; }
+}
 
-  // Start counter with clock (no prescaler)
-  TCCR4B |= (1 << CS40);
+bool stepper_queue_move(const int32_t steps[STEPPER_NUM_AXES]) {
+  _stepper_move_t move;
+  memcpy(move.steps, steps, sizeof(move.steps));
+  if (_stepper_queue_write(&_stepper_queue, (const uint8_t *)&move,
+                           sizeof(move)) != CIRCULAR_BUFFER_OK)
+    return false;
+  _stepper_start();
+  return true;
+}
+
+bool stepper_queue_ready() {
+  return (uint8_t)(STEPPER_QUEUE_BYTES - _stepper_queue_len(&_stepper_queue)) >=
+         sizeof(_stepper_move_t);
+}
+
+// Moves the axis one step forwards (dir is 1) or backwards (dir is -1).
+static inline void _stepper_axis_step(_stepper_axis_t *axis, int8_t dir) {
+  axis->index = (uint8_t)(axis->index - dir) & (_STEPPER_NUM_STATES - 1);
+  axis->position += dir;
+  _stepper_axis_output(axis);
 }
 
 void stepper_step_ccw() {
-  _stepper_index = (_stepper_index + 1) % sizeof(_stepper_states);
-  STEPPER_PORT = _stepper_states[_stepper_index];
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    _stepper_axis_step(&_stepper_axes[0], -1);
+  }
 }
 
 void stepper_step_cw() {
-  _stepper_index = (_stepper_index - 1) % sizeof(_stepper_states);
-  STEPPER_PORT = _stepper_states[_stepper_index];
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    _stepper_axis_step(&_stepper_axes[0], 1);
+  }
+}
+
+bool stepper_done() {
+  bool moving;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    moving = _stepper_dir != 0 || _stepper_offset != 0;
+  }
+  return !moving && _stepper_queue_len(&_stepper_queue) == 0;
 }
 
-bool stepper_done() { return _stepper_offset == 0; }
+// Takes the next move from the queue, returning false if there is none.
+static inline bool _stepper_next_move() {
+  _stepper_move_t move;
+  if (_stepper_queue_len(&_stepper_queue) < sizeof(move))
+    return false;
+  _stepper_queue_read_and_advance((uint8_t *)&move, sizeof(move),
+                                  &_stepper_queue);
 
-ISR(TIMER4_COMPA_vect) {
-  if (_stepper_offset < 0) {
-    stepper_step_ccw();
-    _stepper_offset++;
-  } else if (_stepper_offset > 0) {
-    stepper_step_cw();
-    _stepper_offset--;
+  uint32_t major = 0;
+  for (uint8_t i = 0; i < STEPPER_NUM_AXES; ++i) {
+    int32_t steps = move.steps[i];
+    _stepper_sign[i] = steps < 0 ? -1 : 1;
+    _stepper_delta[i] = steps < 0 ? -steps : steps;
+    _stepper_error[i] = 0;
+    if (_stepper_delta[i] > major)
+      major = _stepper_delta[i];
+  }
+  _stepper_major = major ? major : 1;
+  _stepper_single = false;
+  _stepper_offset = major;
+  return true;
+}
+
+#if STEPPER_HOLD_MS > 0
+// Ticks left until the coils are released
+uint32_t _stepper_hold_ticks;
+#endif
+
+// Keeps the timer running while the coils are held after a move, releasing
+// them and stopping the timer once the hold time has passed.
+static inline void _stepper_idle(bool stopped) {
+#if STEPPER_HOLD_MS > 0
+  if (stopped)
+    _stepper_hold_ticks = _STEPPER_HOLD_TICKS;
+  if (_stepper_hold_ticks > 0) {
+    uint16_t wait = _stepper_hold_ticks > 0xffff ? 0xffff : _stepper_hold_ticks;
+    if (wait < _STEPPER_MIN_TICKS)
+      wait = _STEPPER_MIN_TICKS;
+    _stepper_hold_ticks =
+        _stepper_hold_ticks > wait ? _stepper_hold_ticks - wait : 0;
+    OCR4A = wait - 1;
+    return;
+  }
+  stepper_release();
+#else
+  (void)stopped;
+#endif
+  TCCR4B &= ~(1 << CS41);
+}
+
+// Computes the interval until the next step, as by David Austin's integer
+// approximation c_n = c_(n-1) - 2 c_(n-1) / (4n + 1). With constant
+// acceleration the steps needed to stop equal the steps taken to reach the
+// speed, so the ramp step n tells when to start decelerating.
+static inline void _stepper_update(int32_t offset) {
+  int8_t dir = _stepper_dir;
+  int32_t n = _stepper_n;
+  uint32_t c = _stepper_c;
+  uint32_t c0 = _stepper_c0 > _stepper_cmin ? _stepper_c0 : _stepper_cmin;
+  uint32_t steps_to_stop = n < 0 ? -n : n;
+
+  bool ahead = dir > 0 ? offset > 0 : dir < 0 && offset < 0;
+  uint32_t distance = !ahead ? 0 : offset < 0 ? -offset : offset;
+
+  if (!ahead && steps_to_stop <= 1) {
+    // Standing still, so set out towards the target, or on the next move
+    // without waiting for the main loop.
+    while (offset == 0 && _stepper_next_move())
+      offset = _stepper_offset;
+    n = 0;
+    c = c0;
+    dir = offset > 0 ? 1 : offset < 0 ? -1 : 0;
+    if (dir == 0) {
+      _stepper_idle(_stepper_dir != 0);
+      _stepper_dir = 0;
+      _stepper_n = 0;
+      return;
+    }
   } else {
-    TCCR4B &= ~(1 << CS40);
+    if (n > 0 && steps_to_stop >= distance)
+      n = -n;
+    else if (n < 0 && steps_to_stop < distance)
+      n = -n;
+
+    n++;
+    if (n == 0) {
+      c = c0;
+    } else {
+      c -= (int32_t)(2 * c) / (4 * n + 1);
+      if (n > 0 && c < _stepper_cmin) {
+        // Cruising, where the ramp step is kept as the steps to stop
+        c = _stepper_cmin;
+        n--;
+      }
+      if (c > c0)
+        c = c0;
+    }
   }
+
+  _stepper_dir = dir;
+  _stepper_n = n;
+  _stepper_c = c;
+  OCR4A = (c >> 8) - 1;
+}
+
+ISR(TIMER4_COMPA_vect) {
+  PROFILE_ISR_ENTER(PROFILE_STEPPER);
+  int32_t offset = _stepper_offset;
+  int8_t dir = _stepper_dir;
+  if (dir != 0) {
+    for (uint8_t i = 0; i < STEPPER_NUM_AXES; ++i) {
+      _stepper_error[i] += _stepper_delta[i];
+      if (2 * _stepper_error[i] >= (int32_t)_stepper_major) {
+        _stepper_error[i] -= _stepper_major;
+        _stepper_axis_step(&_stepper_axes[i], dir * _stepper_sign[i]);
+      }
+    }
+    offset -= dir;
+  }
+  _stepper_offset = offset;
+
+  _stepper_update(offset);
+  PROFILE_ISR_EXIT(PROFILE_STEPPER);
 }
 
 #endif /* ifndef AVRO_STEPPER_H */
@@ -0,0 +1,176 @@
+/******************************************************************************
+ * File:             system.h
+ *
+ * Author:           Ole Martin Ruud
+ * Created:          10/14/26
+ * Description:      A millisecond system tick and a cooperative scheduler of
+ *                   periodic tasks. NB! Uses TIMER0.
+ *****************************************************************************/
+
+#ifndef AVRO_SYSTEM_H
+#define AVRO_SYSTEM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+// Every module claims the timers, interrupts and ports it uses by defining
+// AVRO_USES_<resource>, and fails to compile if it is already defined, so two
+// modules cannot silently take the same hardware. The resources are
+// AVRO_USES_TIMER0 to AVRO_USES_TIMER5, AVRO_USES_INT2 to AVRO_USES_INT4,
+// AVRO_USES_USART0 to AVRO_USES_USART3, AVRO_USES_TWI, AVRO_USES_PORTA,
+// AVRO_USES_PORTK and AVRO_USES_PORTC_LOW for the lower 4 bits of PORTC. NB!
+// USART1 also claims INT2 and INT3, which share its pins. A module using
+// custom ports (e.g. STEPPER_CUSTOM_PORT) does not claim the default ones.
+#ifdef AVRO_USES_TIMER0
+#error "system.h: TIMER0 is already in use"
+#endif
+#define AVRO_USES_TIMER0
+
+// Most tasks which can be added.
+#ifndef SYSTEM_MAX_TASKS
+#define SYSTEM_MAX_TASKS 8
+#endif
+
+// PUBLIC
+
+typedef void (*system_task_t)();
+
+// Starts the tick, counting milliseconds with Timer0.
+void init_system();
+// Milliseconds since init_system, wrapping around after about 49 days.
+uint32_t system_millis();
+
+// Adds a task run every period, which is late if it has not started within
+// the deadline after it became due, where a deadline of 0 is the period.
+// Returns false if there is no room for the task.
+//
+// E.g. the keypad could be scanned and the LCD refreshed with
+//   void scan_keys() { ... }
+//   void refresh_lcd() { lcd_refresh(); }
+//
+//   system_add_task(scan_keys, 10, 0);
+//   system_add_task(refresh_lcd, 50, 0);
+bool system_add_task(system_task_t task, uint16_t period_ms,
+                     uint16_t deadline_ms);
+// Runs the due task with the earliest deadline, returning false if no task
+// was due. Tasks are never interrupted by other tasks, so call this
+// repeatedly from the main loop, and keep every task short.
+bool system_run_task();
+// Returns the amount of times a task started after its deadline, and clears
+// the count.
+uint16_t system_missed_deadlines();
+
+// PRIVATE
+
+typedef struct {
+  system_task_t run;
+  uint16_t period_ms;
+  uint16_t deadline_ms;
+  // When the task is due next
+  uint32_t due;
+} _system_task_t;
+
+// The smallest prescaler of Timer0 where a millisecond fits in 8 bits, which
+// divides it exactly at the usual clocks (8 at 1 MHz, 64 at 16 MHz).
+#if F_CPU / 8 / 1000 <= 256
+#define _SYSTEM_PRESCALER 8
+#define _SYSTEM_CLOCK_SELECT (1 << CS01)
+#elif F_CPU / 64 / 1000 <= 256
+#define _SYSTEM_PRESCALER 64
+#define _SYSTEM_CLOCK_SELECT ((1 << CS01) | (1 << CS00))
+#else
+#define _SYSTEM_PRESCALER 256
+#define _SYSTEM_CLOCK_SELECT (1 << CS02)
+#endif
+// Ticks of a millisecond, rounded to the nearest
+#define _SYSTEM_TICKS                                                          \
+  ((F_CPU + _SYSTEM_PRESCALER * 500UL) / (_SYSTEM_PRESCALER * 1000UL))
+
+_Static_assert(_SYSTEM_TICKS <= 256, "F_CPU is too high for the system tick");
+_Static_assert((_SYSTEM_TICKS * _SYSTEM_PRESCALER * 1000UL > F_CPU
+                    ? _SYSTEM_TICKS * _SYSTEM_PRESCALER * 1000UL - F_CPU
+                    : F_CPU - _SYSTEM_TICKS * _SYSTEM_PRESCALER * 1000UL) *
+                       100 <
+                   F_CPU,
+               "The system tick is more than 1% off a millisecond");
+
+_system_task_t _system_tasks[SYSTEM_MAX_TASKS];
+uint8_t _system_num_tasks = 0;
+uint16_t _system_missed = 0;
+
+volatile uint32_t _system_ms = 0;
+
+void init_system() {
+  // Tick every millisecond in CTC mode
+  OCR0A = _SYSTEM_TICKS - 1;
+  TCCR0A = (1 << WGM01);
+  TCCR0B = _SYSTEM_CLOCK_SELECT;
+
+  // Enable compare A interrupt
+  TIMSK0 |= (1 << OCIE0A);
+}
+
+uint32_t system_millis() {
+  uint32_t ms;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { ms = _system_ms; }
+  return ms;
+}
+
+bool system_add_task(system_task_t task, uint16_t period_ms,
+                     uint16_t deadline_ms) {
+  if (_system_num_tasks == SYSTEM_MAX_TASKS)
+    return false;
+
+  _system_task_t *t = &_system_tasks[_system_num_tasks++];
+  t->run = task;
+  t->period_ms = period_ms;
+  t->deadline_ms = deadline_ms ? deadline_ms : period_ms;
+  t->due = system_millis();
+  return true;
+}
+
+bool system_run_task() {
+  uint32_t now = system_millis();
+
+  // Earliest deadline first, among the tasks which are due
+  _system_task_t *next = 0;
+  int32_t next_slack = 0;
+  for (uint8_t i = 0; i < _system_num_tasks; ++i) {
+    _system_task_t *t = &_system_tasks[i];
+    if ((int32_t)(now - t->due) < 0)
+      continue;
+    int32_t slack = (int32_t)(t->due + t->deadline_ms - now);
+    if (!next || slack < next_slack) {
+      next = t;
+      next_slack = slack;
+    }
+  }
+  if (!next)
+    return false;
+
+  if (next_slack < 0 && _system_missed < UINT16_MAX)
+    _system_missed++;
+
+  // Keep the period steady, unless the task is so late that it would have to
+  // catch up on several runs.
+  next->due += next->period_ms;
+  if ((int32_t)(now - next->due) >= 0)
+    next->due = now + next->period_ms;
+
+  next->run();
+  return true;
+}
+
+uint16_t system_missed_deadlines() {
+  uint16_t missed = _system_missed;
+  _system_missed = 0;
+  return missed;
+}
+
+ISR(TIMER0_COMPA_vect) { _system_ms++; }
+
+#endif /* ifndef AVRO_SYSTEM_H */
@@ -12,19 +12,71 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include <avr/interrupt.h>
 #include <avr/io.h>
 
+#include <util/atomic.h>
+#include <util/delay.h>
 #include <util/twi.h>
 
+#include "power.h"
+#include "profile.h"
+
+// Claim the hardware, see system.h
+#ifdef AVRO_USES_TWI
+#error "twi.h: TWI is already in use"
+#endif
+#define AVRO_USES_TWI
+
+// Maximum amount of transactions queued at once, which must be a power of two.
+#ifndef TWI_QUEUE_SIZE
+#define TWI_QUEUE_SIZE 8
+#endif
+
+// SCL frequency set by init_twi. 400 kHz (Fast Mode) is the highest most
+// devices support.
+#ifndef TWI_SCL_HZ
+#define TWI_SCL_HZ 100000
+#endif
+
+// How long (in microseconds) the blocking functions wait for each step of a
+// transfer, before giving up and clearing the bus.
+#ifndef TWI_TIMEOUT_US
+#define TWI_TIMEOUT_US 5000
+#endif
+
+// The blocking functions sleep in idle mode while waiting for the queued
+// transactions, and the TWI interrupt wakes them. They also sleep during each
+// step of their own transfer if system.h is included before this, as the
+// timeout is then counted by the system tick. NB! init_system must then be
+// called before them. Otherwise they spin, counting the time themselves.
+
 // PUBLIC
 
 void init_twi();
+// Initializes TWI with the highest SCL frequency at or below scl_hz which can
+// be generated from F_CPU.
+static inline void init_twi_hz(uint32_t scl_hz);
 
-void twi_send_blocking(uint8_t addr, uint8_t value);
+typedef enum {
+  TWI_OK,
+  // No device acknowledged the address
+  TWI_ERROR_ADDR_NACK,
+  // The device did not acknowledge a byte written to it
+  TWI_ERROR_DATA_NACK,
+  // Another master took the bus
+  TWI_ERROR_ARB_LOST,
+  // An illegal START or STOP, or an unexpected status
+  TWI_ERROR_BUS,
+  // The bus got stuck (e.g. a device holding SDA low), and was cleared
+  TWI_ERROR_TIMEOUT,
+} twi_error_t;
+
+twi_error_t twi_send_blocking(uint8_t addr, uint8_t value);
 uint8_t twi_read_blocking(uint8_t addr);
-void twi_transfer_blocking(uint8_t addr, uint8_t *buf, uint8_t len);
+twi_error_t twi_transfer_blocking(uint8_t addr, uint8_t *buf, uint8_t len);
 
 typedef enum {
   READY,
@@ -33,27 +85,101 @@ typedef enum {
 } twi_status_t;
 
 twi_status_t twi_status();
+// The error of the last twi_send, twi_read, twi_transfer or twi_write_read.
+twi_error_t twi_error();
 void twi_send(uint8_t addr, uint8_t value);
 void twi_read(uint8_t addr, uint8_t *value);
 void twi_transfer(uint8_t addr, uint8_t *buf, uint8_t len);
 
+// A transfer to a single device, which first writes write_len bytes and then
+// reads read_len bytes, with a repeated START in between. Either part may be
+// empty.
+typedef struct twi_transaction_t {
+  // The 7-bit address of the device
+  uint8_t addr;
+  const uint8_t *write_buf;
+  uint8_t write_len;
+  uint8_t *read_buf;
+  uint8_t read_len;
+  // Called from the TWI interrupt when the transaction is done, may be NULL.
+  void (*callback)(struct twi_transaction_t *transaction);
+  // PENDING while queued, and READY or ERROR when done.
+  volatile twi_status_t status;
+  volatile twi_error_t error;
+} twi_transaction_t;
+
+// Queues a transaction, returning false if the queue is full. Queued
+// transactions are done back to back with a repeated START in between, so
+// the bus is kept until the queue is empty. NB! The transaction and its
+// buffers must be kept alive until it is done.
+bool twi_queue(twi_transaction_t *transaction);
+
+// Gives up on the queued transaction in progress, which fails with
+// TWI_ERROR_TIMEOUT, clears the bus and goes on with the next one. Call this
+// when a transaction has been pending for too long, as the interrupt never
+// comes if the bus is stuck.
+void twi_abort();
+
+// Frees a bus where a device holds SDA low (e.g. after a reset in the middle
+// of a read), by clocking SCL up to 9 times and sending a STOP.
+void twi_bus_clear();
+
+// Writes to and then reads from the device (with a 7-bit address) in a single
+// transaction, with a repeated START in between, as used to read registers.
+// The blocking version returns the error, while the status of the other is
+// given by twi_status and twi_error.
+twi_error_t twi_write_read_blocking(uint8_t addr, const uint8_t *write_buf,
+                                    uint8_t write_len, uint8_t *read_buf,
+                                    uint8_t read_len);
+void twi_write_read(uint8_t addr, const uint8_t *write_buf, uint8_t write_len,
+                    uint8_t *read_buf, uint8_t read_len);
+
 // PRIVATE
 
-void init_twi() {
-  // Set SCL and SDA to input with pullup resistors
-  DDRD &= ~(1 << PD0) & ~(1 << PD1);
-  PORTD |= (1 << PD0) | (1 << PD1);
+// The TWI pins, used directly when clearing the bus
+#define _TWI_SCL PD0
+#define _TWI_SDA PD1
+
+static inline uint16_t _twi_clock_setting(uint32_t scl_hz) {
+  // SCL = F_CPU / (16 + 2 * TWBR * 4^prescaler), so pick the smallest
+  // prescaler where TWBR fits, with TWBR rounded up to stay at or below
+  // scl_hz. When scl_hz is a constant, all of this is done at compile time.
+  uint32_t cycles = (F_CPU + scl_hz - 1) / scl_hz;
+  uint32_t half = cycles > 16 ? (cycles - 16 + 1) / 2 : 0;
+
+  uint8_t prescaler = 0;
+  uint32_t twbr = half;
+  while (twbr > 0xff && prescaler < 3) {
+    prescaler++;
+    twbr = (half + (1UL << (2 * prescaler)) - 1) >> (2 * prescaler);
+  }
+
+  // Clamp to the slowest possible, which is around 490 Hz at 16 MHz
+  return (prescaler << 8) | (twbr > 0xff ? 0xff : twbr);
+}
 
-  // SCLf = 62.5KHz
-  TWBR = 0;
+static inline void init_twi_hz(uint32_t scl_hz) {
+  // Set SCL and SDA to input with pullup resistors
+  DDRD &= ~(1 << _TWI_SCL) & ~(1 << _TWI_SDA);
+  PORTD |= (1 << _TWI_SCL) | (1 << _TWI_SDA);
 
-  // Use prescaler 1
-  TWSR = 0;
+  uint16_t setting = _twi_clock_setting(scl_hz);
+  TWBR = setting & 0xff;
+  // Prescaler is in TWPS1:0, where the status bits are read only
+  TWSR = setting >> 8;
 
   // Enable TWI with ACK bit and interrupt
   TWCR = (1 << TWINT) | (1 << TWEA) | (1 << TWEN) | (1 << TWIE);
 }
 
+void init_twi() { init_twi_hz(TWI_SCL_HZ); }
+
+// Transaction used by twi_transfer, send and read, whose status is what
+// twi_status reports.
+twi_transaction_t _twi_transfer_transaction = {.status = READY,
+                                               .error = TWI_OK};
+uint8_t _twi_send_value;
+
 typedef enum {
   IDLE,
   BUSY_BLOCKING,
@@ -65,29 +191,23 @@ typedef enum {
 } twi_internal_state_t;
 
 volatile twi_internal_state_t _twi_state = IDLE;
-volatile uint8_t _twi_addr;
 volatile uint8_t _twi_buf_index;
-volatile uint8_t *_twi_buf;
-volatile uint8_t _twi_buf_len;
 
-twi_status_t twi_status() {
-  switch (_twi_state) {
-  case IDLE:
-    return READY;
-  case SENT_START:
-  case SENT_READ_ADDR:
-  case SENT_READ_DATA:
-  case SENT_WRITE_ADDR:
-  case SENT_WRITE_DATA:
-  case BUSY_BLOCKING:
-    return PENDING;
-  default:
-    return ERROR;
-  }
-}
+// Queue of transactions, where the transaction at the tail is the one in
+// progress. The head is only changed by twi_queue and the tail by the
+// interrupt.
+twi_transaction_t *volatile _twi_queue[TWI_QUEUE_SIZE];
+volatile uint8_t _twi_queue_head = 0;
+volatile uint8_t _twi_queue_tail = 0;
+
+#define _TWI_QUEUE_MASK (TWI_QUEUE_SIZE - 1)
+
+twi_status_t twi_status() { return _twi_transfer_transaction.status; }
 
-void twi_send_blocking(uint8_t addr, uint8_t value) {
-  twi_transfer_blocking((addr << 1) | TW_WRITE, &value, 1);
+twi_error_t twi_error() { return _twi_transfer_transaction.error; }
+
+twi_error_t twi_send_blocking(uint8_t addr, uint8_t value) {
+  return twi_transfer_blocking((addr << 1) | TW_WRITE, &value, 1);
 }
 
 uint8_t twi_read_blocking(uint8_t addr) {
@@ -96,65 +216,202 @@ uint8_t twi_read_blocking(uint8_t addr) {
   return value;
 }
 
-void twi_transfer_blocking(uint8_t addr, uint8_t *buf, uint8_t len) {
-  while (_twi_state != IDLE)
-    ;
-  _twi_state = BUSY_BLOCKING;
+// Starts the transaction at the tail of the queue with a START, which is a
+// repeated START if the bus is already ours, or a STOP followed by a START if
+// stop is set. Returns false if the queue is empty. NB! Must be called with
+// interrupts disabled.
+static inline bool _twi_start_next(bool stop) {
+  if (_twi_queue_tail == _twi_queue_head) {
+    return false;
+  }
+
+  _twi_buf_index = 0;
+  _twi_state = SENT_START;
+  TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTA) | (1 << TWIE) |
+         (stop ? (1 << TWSTO) : 0);
+  return true;
+}
+
+static inline twi_error_t _twi_error_from_status(uint8_t status) {
+  switch (status) {
+  case TW_MT_SLA_NACK:
+  case TW_MR_SLA_NACK:
+    return TWI_ERROR_ADDR_NACK;
+  case TW_MT_DATA_NACK:
+    return TWI_ERROR_DATA_NACK;
+  case TW_MT_ARB_LOST: // Same as TW_MR_ARB_LOST
+    return TWI_ERROR_ARB_LOST;
+  default:
+    return TWI_ERROR_BUS;
+  }
+}
+
+// Waits for the current step of a blocking transfer, and checks that it ended
+// with the expected status.
+static inline twi_error_t _twi_wait(uint8_t expected) {
+#ifdef AVRO_SYSTEM_H
+  if (SREG & (1 << SREG_I)) {
+    // Let the TWI interrupt wake us when the step is done, and the tick count
+    // the timeout. The interrupt turns itself off again, as it would
+    // otherwise keep firing until the next step clears TWINT. NB! The next
+    // tick may come right away, so wait for one more.
+    uint32_t start = system_millis();
+    uint32_t timeout_ms = (TWI_TIMEOUT_US + 999) / 1000 + 1;
+    TWCR = (TWCR & ~(1 << TWINT)) | (1 << TWIE);
+    POWER_IDLE_WHILE(!(TWCR & (1 << TWINT)) &&
+                     _system_ms - start < timeout_ms);
+    if (!(TWCR & (1 << TWINT)))
+      return TWI_ERROR_TIMEOUT;
+  }
+#endif
+  uint32_t waited = 0;
+  while (!(TWCR & (1 << TWINT))) {
+    if (waited++ >= TWI_TIMEOUT_US)
+      return TWI_ERROR_TIMEOUT;
+    _delay_us(1);
+  }
+
+  return TW_STATUS == expected ? TWI_OK : _twi_error_from_status(TW_STATUS);
+}
+
+// Drives a TWI pin low, or releases it to be pulled high, as an open drain
+// output.
+static inline void _twi_pin_low(uint8_t pin) {
+  PORTD &= ~(1 << pin);
+  DDRD |= (1 << pin);
+}
+
+static inline void _twi_pin_release(uint8_t pin) {
+  DDRD &= ~(1 << pin);
+  PORTD |= (1 << pin);
+}
+
+void twi_bus_clear() {
+  // Take the pins back from the TWI
+  TWCR = 0;
+  _twi_pin_release(_TWI_SDA);
+  _twi_pin_release(_TWI_SCL);
+  _delay_us(5);
+
+  // Clock out whatever the device is sending, until it releases SDA
+  for (uint8_t i = 0; i < 9 && !(PIND & (1 << _TWI_SDA)); ++i) {
+    _twi_pin_low(_TWI_SCL);
+    _delay_us(5);
+    _twi_pin_release(_TWI_SCL);
+    _delay_us(5);
+  }
+
+  // STOP, by releasing SDA while SCL is high
+  _twi_pin_low(_TWI_SCL);
+  _twi_pin_low(_TWI_SDA);
+  _delay_us(5);
+  _twi_pin_release(_TWI_SCL);
+  _delay_us(5);
+  _twi_pin_release(_TWI_SDA);
+  _delay_us(5);
+
+  // Enable TWI with ACK bit and interrupt
+  TWCR = (1 << TWEA) | (1 << TWEN) | (1 << TWIE);
+}
+
+twi_error_t twi_write_read_blocking(uint8_t addr, const uint8_t *write_buf,
+                                    uint8_t write_len, uint8_t *read_buf,
+                                    uint8_t read_len) {
+  // Sleep until the queued transactions are finished, and keep them from
+  // starting. NB! They may be queued from interrupts, so check again when
+  // taking the bus.
+  bool idle = false;
+  while (!idle) {
+    POWER_IDLE_WHILE(_twi_state != IDLE);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (_twi_state == IDLE) {
+        _twi_state = BUSY_BLOCKING;
+        idle = true;
+      }
+    }
+  }
+
+  twi_error_t error;
 
   TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTA);
-  while (!(TWCR & (1 << TWINT)))
-    ;
-  if (TW_STATUS != TW_START) {
+  if ((error = _twi_wait(TW_START)) != TWI_OK) {
     goto cleanup;
   }
 
-  TWDR = addr;
-  TWCR = (1 << TWINT) | (1 << TWEN);
-  while (!(TWCR & (1 << TWINT)))
-    ;
-
-  if (addr & TW_READ) {
-    if (TW_STATUS != TW_MR_SLA_ACK) {
+  if (write_len > 0 || read_len == 0) {
+    TWDR = (addr << 1) | TW_WRITE;
+    TWCR = (1 << TWINT) | (1 << TWEN);
+    if ((error = _twi_wait(TW_MT_SLA_ACK)) != TWI_OK) {
       goto cleanup;
     }
 
-    for (int i = 0; i < len; ++i) {
+    for (int i = 0; i < write_len; ++i) {
+      TWDR = write_buf[i];
       TWCR = (1 << TWINT) | (1 << TWEN);
-      while (!(TWCR & (1 << TWINT)))
-        ;
-
-      if (TW_STATUS != TW_MR_DATA_ACK) {
+      if ((error = _twi_wait(TW_MT_DATA_ACK)) != TWI_OK) {
         goto cleanup;
       }
+    }
 
-      buf[i] = TWDR;
+    if (read_len > 0) {
+      // Turn the bus around for reading, without releasing it
+      TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTA);
+      if ((error = _twi_wait(TW_REP_START)) != TWI_OK) {
+        goto cleanup;
+      }
     }
-  } else {
-    if (TW_STATUS != TW_MT_SLA_ACK) {
+  }
+
+  if (read_len > 0) {
+    TWDR = (addr << 1) | TW_READ;
+    TWCR = (1 << TWINT) | (1 << TWEN);
+    if ((error = _twi_wait(TW_MR_SLA_ACK)) != TWI_OK) {
       goto cleanup;
     }
 
-    for (int i = 0; i < len; ++i) {
-      TWDR = buf[i];
-      TWCR = (1 << TWINT) | (1 << TWEN);
-
-      while (!(TWCR & (1 << TWINT)))
-        ;
-
-      if (TW_STATUS != TW_MT_DATA_ACK) {
+    for (int i = 0; i < read_len; ++i) {
+      // ACK every byte but the last one, to tell the device we are done
+      bool last = i == read_len - 1;
+      TWCR = (1 << TWINT) | (1 << TWEN) | (last ? 0 : (1 << TWEA));
+      if ((error = _twi_wait(last ? TW_MR_DATA_NACK : TW_MR_DATA_ACK)) !=
+          TWI_OK) {
         goto cleanup;
       }
+
+      read_buf[i] = TWDR;
     }
   }
-  TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
 
 cleanup:
-  _twi_state = IDLE;
+  if (error == TWI_ERROR_TIMEOUT) {
+    twi_bus_clear();
+  } else if (error != TWI_ERROR_ARB_LOST) {
+    // Release the bus, which also recovers from a bus error. NB! When
+    // arbitration is lost, the bus is already released.
+    TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    _twi_state = IDLE;
+    // Start whatever was queued in the meantime
+    _twi_start_next(false);
+  }
+  return error;
+}
+
+twi_error_t twi_transfer_blocking(uint8_t addr, uint8_t *buf, uint8_t len) {
+  if (addr & TW_READ) {
+    return twi_write_read_blocking(addr >> 1, NULL, 0, buf, len);
+  } else {
+    return twi_write_read_blocking(addr >> 1, buf, len, NULL, 0);
+  }
 }
 
 void twi_send(uint8_t addr, uint8_t value) {
-  uint8_t buf[] = {value};
-  twi_transfer((addr << 1) | TW_WRITE, buf, sizeof(buf));
+  // NB! The value has to outlive the call, as it is sent asynchronously.
+  assert(_twi_transfer_transaction.status != PENDING);
+  _twi_send_value = value;
+  twi_transfer((addr << 1) | TW_WRITE, &_twi_send_value, 1);
 }
 
 void twi_read(uint8_t addr, uint8_t *value) {
@@ -163,81 +420,176 @@ void twi_read(uint8_t addr, uint8_t *value) {
 
 void twi_transfer(uint8_t addr, uint8_t *buf, uint8_t len) {
   assert(len > 0);
-  assert(_twi_state != BUSY_BLOCKING);
+  if (addr & TW_READ) {
+    twi_write_read(addr >> 1, NULL, 0, buf, len);
+  } else {
+    twi_write_read(addr >> 1, buf, len, NULL, 0);
+  }
+}
 
-  _twi_buf_index = 0;
-  _twi_buf = buf;
-  _twi_buf_len = len;
-  _twi_addr = addr;
-  TWCR = (1 << TWINT) + (1 << TWEN) + (1 << TWSTA);
-  _twi_state = SENT_START;
+void twi_write_read(uint8_t addr, const uint8_t *write_buf, uint8_t write_len,
+                    uint8_t *read_buf, uint8_t read_len) {
+  // Only one transfer may be in progress, use twi_queue for more.
+  assert(_twi_transfer_transaction.status != PENDING);
+
+  twi_transaction_t *transaction = &_twi_transfer_transaction;
+  transaction->addr = addr;
+  transaction->write_buf = write_buf;
+  transaction->write_len = write_len;
+  transaction->read_buf = read_buf;
+  transaction->read_len = read_len;
+  transaction->callback = NULL;
+
+  bool queued = twi_queue(transaction);
+  assert(queued);
+  (void)queued;
+}
+
+bool twi_queue(twi_transaction_t *transaction) {
+  bool queued = false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t head = _twi_queue_head;
+    if ((uint8_t)(head - _twi_queue_tail) < TWI_QUEUE_SIZE) {
+      transaction->status = PENDING;
+      transaction->error = TWI_OK;
+      _twi_queue[head & _TWI_QUEUE_MASK] = transaction;
+      _twi_queue_head = head + 1;
+      queued = true;
+
+      // A blocking transfer starts the queue when it is done
+      if (_twi_state == IDLE)
+        _twi_start_next(false);
+    }
+  }
+
+  return queued;
+}
+
+// Removes the transaction in progress from the queue, and reports the result.
+static inline void _twi_pop(twi_error_t error) {
+  twi_transaction_t *transaction =
+      _twi_queue[_twi_queue_tail & _TWI_QUEUE_MASK];
+  _twi_queue_tail++;
+
+  transaction->error = error;
+  transaction->status = error == TWI_OK ? READY : ERROR;
+  if (transaction->callback)
+    transaction->callback(transaction);
+}
+
+// Finishes the transaction in progress, and continues with the next queued
+// one. NB! Only called from the interrupt.
+static inline void _twi_finish(twi_error_t error) {
+  _twi_pop(error);
+
+  // Keep the bus and go right on with the next transaction, but release a
+  // device which failed with a STOP first. When arbitration is lost the bus
+  // is already released, and a START is sent when it is free again.
+  bool stop = error != TWI_OK && error != TWI_ERROR_ARB_LOST;
+  if (!_twi_start_next(stop)) {
+    TWCR = (1 << TWINT) | (1 << TWEN) |
+           (error != TWI_ERROR_ARB_LOST ? (1 << TWSTO) : 0);
+    _twi_state = IDLE;
+  }
+}
+
+void twi_abort() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (_twi_state != IDLE && _twi_state != BUSY_BLOCKING) {
+      _twi_pop(TWI_ERROR_TIMEOUT);
+      twi_bus_clear();
+      _twi_state = IDLE;
+      _twi_start_next(false);
+    }
+  }
+}
+
+// Sends the address of the current transaction, for writing if there is
+// anything left to write.
+static inline void _twi_send_addr(const twi_transaction_t *transaction) {
+  if (_twi_buf_index < transaction->write_len || transaction->read_len == 0) {
+    TWDR = (transaction->addr << 1) | TW_WRITE;
+    _twi_state = SENT_WRITE_ADDR;
+  } else {
+    TWDR = (transaction->addr << 1) | TW_READ;
+    _twi_state = SENT_READ_ADDR;
+    // The read part was started by a repeated START, so start over
+    _twi_buf_index = 0;
+  }
+  TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+}
+
+// Continues reading, and ACKs the next byte unless it is the last one.
+static inline void _twi_read_next(const twi_transaction_t *transaction) {
+  if (_twi_buf_index + 1 < transaction->read_len) {
+    TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWEA) | (1 << TWIE);
+  } else {
+    TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+  }
+  _twi_state = SENT_READ_DATA;
 }
 
 ISR(TWI_vect) {
+  PROFILE_ISR_ENTER(PROFILE_TWI);
+  twi_transaction_t *transaction =
+      _twi_queue[_twi_queue_tail & _TWI_QUEUE_MASK];
+
   switch (_twi_state) {
   case SENT_START:
-    if (TW_STATUS == TW_START) {
-      TWDR = _twi_addr;
-      TWCR = (1 << TWINT) | (1 << TWEN);
-      _twi_state = _twi_addr & TW_READ ? SENT_READ_ADDR : SENT_WRITE_ADDR;
+    if (TW_STATUS == TW_START || TW_STATUS == TW_REP_START) {
+      _twi_send_addr(transaction);
     } else {
-      _twi_state = IDLE;
+      _twi_finish(_twi_error_from_status(TW_STATUS));
     }
     break;
   case SENT_WRITE_ADDR:
-    if (TW_STATUS == TW_MT_SLA_ACK) {
-      TWDR = _twi_buf[_twi_buf_index++];
-      TWCR = (1 << TWINT) | (1 << TWEN);
-      _twi_state = SENT_WRITE_DATA;
-    } else {
-      _twi_state = IDLE;
-    }
-    break;
   case SENT_WRITE_DATA:
-    if (TW_STATUS == TW_MT_DATA_ACK) {
-      if (_twi_buf_index < _twi_buf_len) {
-        TWDR = _twi_buf[_twi_buf_index++];
-        TWCR = (1 << TWINT) | (1 << TWEN);
+    if (TW_STATUS == TW_MT_SLA_ACK || TW_STATUS == TW_MT_DATA_ACK) {
+      if (_twi_buf_index < transaction->write_len) {
+        TWDR = transaction->write_buf[_twi_buf_index++];
+        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
         _twi_state = SENT_WRITE_DATA;
+      } else if (transaction->read_len > 0) {
+        // Entire buffer was sent, turn the bus around for reading
+        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTA) | (1 << TWIE);
+        _twi_state = SENT_START;
       } else {
-        // Entire buffer was sent, send stop condition
-        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
-        _twi_state = IDLE;
+        _twi_finish(TWI_OK);
       }
     } else {
-      _twi_state = IDLE;
+      _twi_finish(_twi_error_from_status(TW_STATUS));
     }
     break;
   case SENT_READ_ADDR:
     if (TW_STATUS == TW_MR_SLA_ACK) {
-      TWCR = (1 << TWINT) | (1 << TWEN);
-      _twi_state = SENT_READ_DATA;
+      _twi_read_next(transaction);
     } else {
-      _twi_state = IDLE;
+      _twi_finish(_twi_error_from_status(TW_STATUS));
     }
     break;
   case SENT_READ_DATA:
-    if (TW_STATUS == TW_MR_DATA_ACK) {
-      if (_twi_buf_index < _twi_buf_len) {
-        _twi_buf[_twi_buf_index++] = TWDR;
-        TWCR = (1 << TWINT) | (1 << TWEN);
-        _twi_state = SENT_READ_DATA;
+    // NB! The last byte is NACKed to tell the device we are done.
+    if (TW_STATUS == TW_MR_DATA_ACK || TW_STATUS == TW_MR_DATA_NACK) {
+      transaction->read_buf[_twi_buf_index++] = TWDR;
+      if (_twi_buf_index < transaction->read_len) {
+        _twi_read_next(transaction);
       } else {
-        // Entire buffer was filled with data, send stop condition
-        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
-        _twi_state = IDLE;
+        _twi_finish(TWI_OK);
       }
     } else {
-      _twi_state = IDLE;
+      _twi_finish(_twi_error_from_status(TW_STATUS));
     }
     break;
   case BUSY_BLOCKING:
-    // This shouldn't happend because interupts for TWI are disabled when
-    // doing blocking send.
+    // A blocking transfer only enables the interrupt to wake up from sleep, so
+    // disable it again, but leave TWINT set for it to see.
+    TWCR &= ~((1 << TWINT) | (1 << TWIE));
     break;
   default:
     break;
   }
+  PROFILE_ISR_EXIT(PROFILE_TWI);
 }
 
 #endif /* ifndef AVRO_TWI_H */
@@ -13,26 +13,117 @@
 #include <avr/interrupt.h>
 #include <avr/io.h>
 
-#include <avr/sleep.h>
+#include <assert.h>
 #include <stdbool.h>
 #include <string.h>
 #include <util/delay.h>
 
 #include "circular_buffer.h"
+#include "power.h"
+#include "profile.h"
+#include "usart_matcher.h"
 
+// Sizes of the send and receive buffers, which must be powers of two. Buffers
+// larger than 128 bytes use 16-bit indices, see CIRCULAR_BUFFER_DEFINE.
+#ifndef TX_BUFFER_SIZE
 #define TX_BUFFER_SIZE 32
+#endif
+#ifndef RX_BUFFER_SIZE
 #define RX_BUFFER_SIZE 32
+#endif
+
+// Amount of USART ports in use, where ports 0 to USART_NUM_PORTS - 1 each get
+// their own send and receive buffers and interrupts. NB! Ports above 0 only
+// exist on the larger devices (e.g. the ATmega2560 has four).
+#ifndef USART_NUM_PORTS
+#define USART_NUM_PORTS 1
+#endif
+
+// Claim the hardware, see system.h
+#ifdef AVRO_USES_USART0
+#error "usart.h: USART0 is already in use"
+#endif
+#define AVRO_USES_USART0
+#if USART_NUM_PORTS > 1
+#ifdef AVRO_USES_USART1
+#error "usart.h: USART1 is already in use"
+#endif
+#define AVRO_USES_USART1
+// NB! RXD1 and TXD1 are the pins of INT2 and INT3 (PD2 and PD3), so those can
+// not be used either.
+#ifdef AVRO_USES_INT2
+#error "usart.h: INT2, on the pin of RXD1, is already in use"
+#endif
+#define AVRO_USES_INT2
+#ifdef AVRO_USES_INT3
+#error "usart.h: INT3, on the pin of TXD1, is already in use"
+#endif
+#define AVRO_USES_INT3
+#endif
+#if USART_NUM_PORTS > 2
+#ifdef AVRO_USES_USART2
+#error "usart.h: USART2 is already in use"
+#endif
+#define AVRO_USES_USART2
+#endif
+#if USART_NUM_PORTS > 3
+#ifdef AVRO_USES_USART3
+#error "usart.h: USART3 is already in use"
+#endif
+#define AVRO_USES_USART3
+#endif
 
 // PUBLIC
 
-void init_usart();
+typedef enum {
+  USART_PORT0,
+  USART_PORT1,
+  USART_PORT2,
+  USART_PORT3,
+} usart_port_t;
+
+// Framing of each character, combine one of each group, e.g.
+// USART_DATA_BITS_8 | USART_PARITY_NONE | USART_STOP_BITS_1.
+#define USART_DATA_BITS_5 0x00
+#define USART_DATA_BITS_6 (1 << UCSZ00)
+#define USART_DATA_BITS_7 (1 << UCSZ01)
+#define USART_DATA_BITS_8 ((1 << UCSZ01) | (1 << UCSZ00))
+
+#define USART_PARITY_NONE 0x00
+#define USART_PARITY_EVEN (1 << UPM01)
+#define USART_PARITY_ODD ((1 << UPM01) | (1 << UPM00))
 
-void usart_send_byte(uint8_t byte);
-void usart_send_bytes(const uint8_t *buf, uint8_t len);
-void usart_send_string(const char *string);
+#define USART_STOP_BITS_1 0x00
+#define USART_STOP_BITS_2 (1 << USBS0)
+
+#define USART_FRAMING_8N1                                                      \
+  (USART_DATA_BITS_8 | USART_PARITY_NONE | USART_STOP_BITS_1)
+
+void init_usart();
+static inline void init_usart_ex(usart_port_t port, uint32_t baud,
+                                 uint8_t framing);
+
+// Queue data to be sent in the background, returning how many bytes were
+// queued. When the send buffer is full only the start of the data is queued,
+// and the rest is dropped and counted, see usart_dropped_bytes.
+bool usart_send_byte(uint8_t byte);
+uint16_t usart_send_bytes(const uint8_t *buf, uint16_t len);
+uint16_t usart_send_string(const char *string);
+
+// The same as above, but sleeps in idle mode while the send buffer is full
+// until either everything is queued or timeout_ms has passed, where 0 means
+// waiting forever. NB! Time is measured by the bytes sent while waiting, so
+// the timeout is only approximate.
+uint16_t usart_send_bytes_timeout(const uint8_t *buf, uint16_t len,
+                                  uint16_t timeout_ms);
+uint16_t usart_send_string_timeout(const char *string, uint16_t timeout_ms);
+
+// Returns the amount of bytes dropped due to a full send buffer since the last
+// call, saturating at UINT16_MAX.
+uint16_t usart_dropped_bytes();
 
 void usart_send_byte_blocking(uint8_t byte);
-void usart_send_bytes_blocking(const uint8_t *buf, uint8_t len);
+void usart_send_bytes_blocking(const uint8_t *buf, uint16_t len);
 void usart_send_string_blocking(const char *string);
 
 uint8_t usart_recv_into(uint8_t *recv_buf, uint8_t max_len);
@@ -41,214 +132,431 @@ void usart_recv_drop_until_blocking(const char *needle, uint8_t *recv_buf,
 uint8_t usart_recv_take_until_blocking(const char *needle, uint8_t *recv_buf,
                                        uint8_t len);
 
-// PRIVATE
+// Non-blocking versions of the above. Drop until leaves the needle and
+// everything after it in the receive buffer, and returns
+// USART_MATCH_NEED_MORE until the needle was found. Take until moves
+// everything before the needle into recv_buf (of length len, including a
+// terminating null) and consumes the needle. After USART_MATCH_FOUND or
+// USART_MATCH_FULL, recv_buf holds matcher->taken bytes, and the next poll
+// starts over at the start of recv_buf (keeping a partial match).
+usart_match_status_t usart_recv_poll_drop_until(usart_matcher_t *matcher);
+usart_match_status_t usart_recv_poll_take_until(usart_matcher_t *matcher,
+                                                uint8_t *recv_buf,
+                                                uint8_t len);
+
+// The same as above, but for a specific port, where the functions above
+// always use USART_PORT0.
+bool usart_port_send_byte(usart_port_t port, uint8_t byte);
+uint16_t usart_port_send_bytes(usart_port_t port, const uint8_t *buf,
+                               uint16_t len);
+uint16_t usart_port_send_string(usart_port_t port, const char *string);
+
+uint16_t usart_port_send_bytes_timeout(usart_port_t port, const uint8_t *buf,
+                                       uint16_t len, uint16_t timeout_ms);
+uint16_t usart_port_send_string_timeout(usart_port_t port, const char *string,
+                                        uint16_t timeout_ms);
+
+uint16_t usart_port_dropped_bytes(usart_port_t port);
+
+void usart_port_send_byte_blocking(usart_port_t port, uint8_t byte);
+void usart_port_send_bytes_blocking(usart_port_t port, const uint8_t *buf,
+                                    uint16_t len);
+void usart_port_send_string_blocking(usart_port_t port, const char *string);
+
+uint8_t usart_port_recv_into(usart_port_t port, uint8_t *recv_buf,
+                             uint8_t max_len);
+void usart_port_recv_drop_until_blocking(usart_port_t port, const char *needle,
+                                         uint8_t *recv_buf, uint8_t len);
+uint8_t usart_port_recv_take_until_blocking(usart_port_t port,
+                                            const char *needle,
+                                            uint8_t *recv_buf, uint8_t len);
+usart_match_status_t usart_port_recv_poll_drop_until(usart_port_t port,
+                                                     usart_matcher_t *matcher);
+usart_match_status_t usart_port_recv_poll_take_until(usart_port_t port,
+                                                     usart_matcher_t *matcher,
+                                                     uint8_t *recv_buf,
+                                                     uint8_t len);
 
-volatile bool _usart_is_sending = false;
+// PRIVATE
 
-uint8_t _usart_send_buffer_inner[TX_BUFFER_SIZE];
-volatile circular_buffer_t _usart_send_buffer = {
-    .buf = _usart_send_buffer_inner,
-    .len = sizeof(_usart_send_buffer_inner),
-    .start = 0,
-    .end = 0,
+// The registers of a port. The bits within the registers are at the same
+// positions for all ports, so the names for port 0 are used (e.g. U2X0).
+typedef struct {
+  volatile uint8_t *ucsra;
+  volatile uint8_t *ucsrb;
+  volatile uint8_t *ucsrc;
+  volatile uint8_t *ubrrl;
+  volatile uint8_t *ubrrh;
+  volatile uint8_t *udr;
+} _usart_regs_t;
+
+// NB! As this is constant, looking up a register for a constant port (as in
+// the interrupts) is resolved at compile time to a direct register access.
+static const _usart_regs_t _usart_regs[USART_NUM_PORTS] = {
+    {&UCSR0A, &UCSR0B, &UCSR0C, &UBRR0L, &UBRR0H, &UDR0},
+#if USART_NUM_PORTS > 1
+    {&UCSR1A, &UCSR1B, &UCSR1C, &UBRR1L, &UBRR1H, &UDR1},
+#endif
+#if USART_NUM_PORTS > 2
+    {&UCSR2A, &UCSR2B, &UCSR2C, &UBRR2L, &UBRR2H, &UDR2},
+#endif
+#if USART_NUM_PORTS > 3
+    {&UCSR3A, &UCSR3B, &UCSR3C, &UBRR3L, &UBRR3H, &UDR3},
+#endif
 };
 
-uint8_t _usart_recv_buffer_inner[RX_BUFFER_SIZE];
-volatile circular_buffer_t _usart_recv_buffer = {
-    .buf = _usart_recv_buffer_inner,
-    .len = sizeof(_usart_recv_buffer_inner),
-    .start = 0,
-    .end = 0,
-};
+volatile bool _usart_is_sending[USART_NUM_PORTS] = {false};
+
+// Time to send a single character (in microseconds) for the configured baud
+// and framing, used to measure send timeouts.
+uint16_t _usart_char_us[USART_NUM_PORTS];
+
+// Bytes dropped due to a full send buffer, see usart_port_dropped_bytes.
+uint16_t _usart_dropped[USART_NUM_PORTS] = {0};
+
+#if TX_BUFFER_SIZE > 128
+CIRCULAR_BUFFER_DEFINE(_usart_tx_ring, uint16_t, TX_BUFFER_SIZE)
+#else
+CIRCULAR_BUFFER_DEFINE(_usart_tx_ring, uint8_t, TX_BUFFER_SIZE)
+#endif
+
+#if RX_BUFFER_SIZE > 128
+CIRCULAR_BUFFER_DEFINE(_usart_rx_ring, uint16_t, RX_BUFFER_SIZE)
+#else
+CIRCULAR_BUFFER_DEFINE(_usart_rx_ring, uint8_t, RX_BUFFER_SIZE)
+#endif
+
+// The scans of the receive functions, kept with the matcher
+USART_MATCHER_RING_DEFINE(_usart_rx, _usart_rx_ring)
+
+// NB! The buffers are shared with the interrupts, but they are not declared
+// volatile as the circular buffer itself synchronizes the accesses.
+_usart_tx_ring_t _usart_send_buffer[USART_NUM_PORTS];
+_usart_rx_ring_t _usart_recv_buffer[USART_NUM_PORTS];
+
+// Flag set in the result of _usart_baud_setting when U2X should be set.
+#define _USART_BAUD_U2X 0x8000
+
+static inline uint16_t _usart_baud_setting(uint32_t baud) {
+  // Try both normal (divide by 16) and double speed (divide by 8) mode, with
+  // UBRR rounded to the nearest value, and pick whichever gives the lowest
+  // error. When the baud is a constant, all of this is done at compile time.
+  uint32_t ubrr_1x = (F_CPU + 8 * baud) / (16 * baud);
+  uint32_t ubrr_2x = (F_CPU + 4 * baud) / (8 * baud);
+
+  // UBRR is 12-bit, and the value stored is one less than the divisor.
+  ubrr_1x = ubrr_1x < 1 ? 1 : ubrr_1x > 4096 ? 4096 : ubrr_1x;
+  ubrr_2x = ubrr_2x < 1 ? 1 : ubrr_2x > 4096 ? 4096 : ubrr_2x;
+
+  uint32_t baud_1x = F_CPU / (16 * ubrr_1x);
+  uint32_t baud_2x = F_CPU / (8 * ubrr_2x);
+  uint32_t error_1x = baud_1x > baud ? baud_1x - baud : baud - baud_1x;
+  uint32_t error_2x = baud_2x > baud ? baud_2x - baud : baud - baud_2x;
+
+  // Prefer normal mode when equal, as it samples each bit more times.
+  if (error_2x < error_1x) {
+    return (ubrr_2x - 1) | _USART_BAUD_U2X;
+  } else {
+    return ubrr_1x - 1;
+  }
+}
+
+static inline void init_usart_ex(usart_port_t port, uint32_t baud,
+                                 uint8_t framing) {
+  assert(port < USART_NUM_PORTS);
+  const _usart_regs_t *regs = &_usart_regs[port];
+
+  uint16_t setting = _usart_baud_setting(baud);
 
-void init_usart() {
-  // Set U2X (Double the USART Tx speed, to reduce clocking error)
-  UCSR0A = (1 << U2X0);
+  // Set U2X (Double the USART Tx speed) if it reduces the clocking error
+  *regs->ucsra = setting & _USART_BAUD_U2X ? (1 << U2X0) : 0;
   // RX Complete Int Enable, RX Enable, TX Enable
-  UCSR0B = (1 << RXCIE0) | (1 << RXEN0) | (1 << TXEN0);
-  // Asynchronous, No Parity, 1 stop, 8-bit data
-  UCSR0C = (1 << UCSZ01) | (1 << UCSZ00) | (1 << UCPOL0);
+  *regs->ucsrb = (1 << RXCIE0) | (1 << RXEN0) | (1 << TXEN0);
+  // Asynchronous with the given framing
+  *regs->ucsrc = framing;
+
+  uint16_t ubrr = setting & ~_USART_BAUD_U2X;
+  *regs->ubrrh = ubrr >> 8;
+  *regs->ubrrl = ubrr & 0xff;
+
+  // Start bit, data bits (UCSZ0 is 5 bits less), parity and stop bits
+  uint8_t bits = 1 + 5 + ((framing >> UCSZ00) & 0x3) +
+                 (framing & (1 << UPM01) ? 1 : 0) +
+                 (framing & (1 << USBS0) ? 2 : 1);
+  _usart_char_us[port] = (bits * 1000000UL + baud - 1) / baud;
+}
+
+void init_usart() { init_usart_ex(USART_PORT0, 9600, USART_FRAMING_8N1); }
 
-  // 9600 baud, UBRR = 12, and  U2X must be set to '1' in UCSRA
-  UBRR0H = 0;
-  UBRR0L = 12;
+uint8_t usart_port_recv_into(usart_port_t port, uint8_t *recv_buf,
+                             uint8_t max_len) {
+  return _usart_rx_ring_read_and_advance(recv_buf, max_len,
+                                         &_usart_recv_buffer[port]);
 }
 
-uint8_t usart_recv_into(uint8_t *recv_buf, uint8_t max_len) {
-  return circular_buffer_read_and_advance(recv_buf, max_len,
-                                          &_usart_recv_buffer);
+usart_match_status_t usart_port_recv_poll_drop_until(usart_port_t port,
+                                                     usart_matcher_t *matcher) {
+  // NB! A partial match is kept in the receive buffer when dropping, so the
+  // whole needle has to fit in it.
+  assert(matcher->needle_len <= RX_BUFFER_SIZE);
+  return _usart_rx_poll_drop_until(&_usart_recv_buffer[port], matcher);
 }
 
-void usart_recv_drop_until_blocking(const char *needle, uint8_t *recv_buf,
-                                    uint8_t len) {
-  uint8_t needle_len = strlen(needle);
-  uint8_t *needle_start;
-  uint8_t total_recv_bytes = 0;
-
-  while (1) {
-    // We are always dropping prior data, so we can advance while we read.
-    uint8_t recv_bytes =
-        circular_buffer_read(recv_buf + total_recv_bytes,
-                             len - 1 - total_recv_bytes, &_usart_recv_buffer);
-    total_recv_bytes += recv_bytes;
-
-    recv_buf[total_recv_bytes] = '\0';
-    needle_start = (uint8_t *)strstr((char *)recv_buf, needle);
-    if (needle_start) {
-      // Only advance the difference between the previous position and the
-      // start of the needle, this keeps everything after the needle in the
-      // recv buffer.
-      circular_buffer_advance((needle_start - recv_buf) -
-                                  (total_recv_bytes - recv_bytes),
-                              &_usart_recv_buffer);
-      return;
-    } else {
-      circular_buffer_advance(recv_bytes, &_usart_recv_buffer);
-    }
-
-    // If we filled the buffer, move the last values to the front, and start
-    // reading to the middle of the buffer. This ensures that a calibrate
-    // command is not dropped if it arrvives in the middle of a buffer move.
-    if (total_recv_bytes >= len - 1) {
-      total_recv_bytes = needle_len;
-      memmove(recv_buf, recv_buf + len - 1 - total_recv_bytes,
-              total_recv_bytes);
-    }
-
-    // Only sleep if we recveived zero bytes, as then we have to wait for the
-    // next RX interrupt.
-    if (recv_bytes == 0)
-      sleep_mode();
-  }
+usart_match_status_t usart_port_recv_poll_take_until(usart_port_t port,
+                                                     usart_matcher_t *matcher,
+                                                     uint8_t *recv_buf,
+                                                     uint8_t len) {
+  assert(len > 1);
+  return _usart_rx_poll_take_until(&_usart_recv_buffer[port], matcher,
+                                   recv_buf, len);
 }
 
-uint8_t usart_recv_take_until_blocking(const char *needle, uint8_t *recv_buf,
-                                       uint8_t len) {
-  uint8_t needle_len = strlen(needle);
-  uint8_t *needle_start;
-  uint8_t total_recv_bytes = 0;
-
-  while (1) {
-    // We want to keep data in recv buffer that is after what we take to
-    // simplify interface.
-    uint8_t recv_bytes =
-        circular_buffer_read(recv_buf + total_recv_bytes,
-                             len - 1 - total_recv_bytes, &_usart_recv_buffer);
-    total_recv_bytes += recv_bytes;
-
-    recv_buf[total_recv_bytes] = '\0';
-    needle_start = (uint8_t *)strstr((char *)recv_buf, needle);
-    if (needle_start) {
-      // We found what we were searching for, so advance recv buffer to
-      // the end of the needle to consume the data, then return the amount of
-      // bytes read (excluding the needle).
-
-      // Only advance the difference between the previous position and the
-      // end of the needle, this keeps everything after the needle in the
-      // recv buffer.
-      circular_buffer_advance((needle_start - recv_buf) -
-                                  (total_recv_bytes - recv_bytes) + needle_len,
-                              &_usart_recv_buffer);
-      return needle_start - recv_buf;
-    } else {
-      circular_buffer_advance(recv_bytes, &_usart_recv_buffer);
-    }
-
-    // If we filled the buffer, sooo this is an error and there isn't much to
-    // do. Simply return what we have read so far.
-    if (total_recv_bytes >= len - 1) {
-      return total_recv_bytes;
-    }
-
-    // Only sleep if we recveived zero bytes, as then we have to wait for the
-    // next RX interrupt.
-    if (recv_bytes == 0)
-      sleep_mode();
+void usart_port_recv_drop_until_blocking(usart_port_t port, const char *needle,
+                                         uint8_t *recv_buf, uint8_t len) {
+  // NB! The data is scanned in place, so recv_buf is no longer needed.
+  (void)recv_buf;
+  (void)len;
+
+  _usart_rx_ring_t *ring = &_usart_recv_buffer[port];
+  usart_matcher_t matcher;
+  usart_matcher_init(&matcher, needle);
+
+  // Sleep until more data is received each time we run out of data. NB! The
+  // poll leaves only the partial match in the buffer, so anything more is new
+  // data, even if it came before we got to sleep.
+  while (usart_port_recv_poll_drop_until(port, &matcher) ==
+         USART_MATCH_NEED_MORE)
+    POWER_IDLE_WHILE(_usart_rx_ring_len(ring) <= matcher.matched);
+}
+
+uint8_t usart_port_recv_take_until_blocking(usart_port_t port,
+                                            const char *needle,
+                                            uint8_t *recv_buf, uint8_t len) {
+  _usart_rx_ring_t *ring = &_usart_recv_buffer[port];
+  usart_matcher_t matcher;
+  usart_matcher_init(&matcher, needle);
+
+  // If we filled the buffer, sooo this is an error and there isn't much to
+  // do. Simply return what we have read so far.
+  while (usart_port_recv_poll_take_until(port, &matcher, recv_buf, len) ==
+         USART_MATCH_NEED_MORE) {
+    // The poll consumes everything it scans, so anything left is new data
+    POWER_IDLE_WHILE(_usart_rx_ring_len(ring) == 0);
   }
+
+  return matcher.taken;
 }
 
-void usart_send_byte(uint8_t byte) {
-  if (_usart_is_sending) {
-    circular_buffer_status_t status =
-        circular_buffer_write(&_usart_send_buffer, &byte, 1);
-    if (status != CIRCULAR_BUFFER_OK) {
-		return;
-    }
-    // Say we are sending and ensure empty data registry interrupt is set
-    _usart_is_sending = true;
-    UCSR0B |= (1 << UDRIE0);
-  } else {
-    // Should not block due to _usart_is_sending is false (which means a
-    // interrupt the the buffer is empty has already come)
-    usart_send_byte_blocking(byte);
+static inline void _usart_count_dropped(usart_port_t port, uint16_t amount) {
+  uint16_t dropped = _usart_dropped[port] + amount;
+  _usart_dropped[port] = dropped < amount ? UINT16_MAX : dropped;
+}
+
+// Queues as much of the data as there is room for, without counting the rest
+// as dropped, and ensures the data is being sent.
+static inline uint16_t _usart_queue_bytes(usart_port_t port,
+                                          const uint8_t *buf, uint16_t len) {
+  _usart_tx_ring_t *ring = &_usart_send_buffer[port];
+  uint16_t queued = 0;
+  uint8_t *span;
+  uint16_t span_len;
+
+  // Copy directly into the free space of the send buffer, which is at most
+  // two spans when it wraps around.
+  while (queued < len && (span_len = _usart_tx_ring_claim_span(ring, &span))) {
+    if (span_len > len - queued)
+      span_len = len - queued;
+    memcpy(span, buf + queued, span_len);
+    _usart_tx_ring_commit(ring, span_len);
+    queued += span_len;
   }
+
+  if (queued > 0) {
+    // Enable empty data registry interrupt to start sending, and say that we
+    // are currently sending.
+    _usart_is_sending[port] = true;
+    *_usart_regs[port].ucsrb |= (1 << UDRIE0);
+  }
+
+  return queued;
+}
+
+bool usart_port_send_byte(usart_port_t port, uint8_t byte) {
+  return usart_port_send_bytes(port, &byte, 1) == 1;
 }
-void usart_send_bytes(const uint8_t *buf, uint8_t len) {
-  // We simply append the data to the send buffer, and ensure that we are
-  // sending when we are ready.
-  circular_buffer_status_t status =
-      circular_buffer_write(&_usart_send_buffer, buf, len);
-  if (status != CIRCULAR_BUFFER_OK) {
-    return;
+
+uint16_t usart_port_send_bytes(usart_port_t port, const uint8_t *buf,
+                               uint16_t len) {
+  uint16_t queued = _usart_queue_bytes(port, buf, len);
+  _usart_count_dropped(port, len - queued);
+  return queued;
+}
+
+uint16_t usart_port_send_string(usart_port_t port, const char *str) {
+  uint16_t len = strlen(str);
+  return usart_port_send_bytes(port, (uint8_t *)str, len);
+}
+
+uint16_t usart_port_send_bytes_timeout(usart_port_t port, const uint8_t *buf,
+                                       uint16_t len, uint16_t timeout_ms) {
+  _usart_tx_ring_t *ring = &_usart_send_buffer[port];
+  uint32_t timeout_us = (uint32_t)timeout_ms * 1000;
+  uint32_t waited_us = 0;
+  uint16_t queued = _usart_queue_bytes(port, buf, len);
+
+  while (queued < len && (timeout_ms == 0 || waited_us < timeout_us)) {
+    uint16_t before = _usart_tx_ring_len(ring);
+
+    // Sleep until the UDRE interrupt frees space
+    POWER_IDLE_WHILE(_usart_tx_ring_len(ring) == before &&
+                     _usart_is_sending[port]);
+
+    // Space is only freed as bytes are sent, which takes a fixed time each.
+    waited_us += (uint32_t)(before - _usart_tx_ring_len(ring)) *
+                 _usart_char_us[port];
+    queued += _usart_queue_bytes(port, buf + queued, len - queued);
   }
 
-  // Enable empty data registry interrupt to start sending, and say that we
-  // are currently sending.
-  _usart_is_sending = true;
-  UCSR0B |= (1 << UDRIE0);
+  _usart_count_dropped(port, len - queued);
+  return queued;
 }
 
-void usart_send_string(const char *str) {
-  uint8_t len = strlen(str);
-  usart_send_bytes((uint8_t *)str, len);
+uint16_t usart_port_send_string_timeout(usart_port_t port, const char *str,
+                                        uint16_t timeout_ms) {
+  uint16_t len = strlen(str);
+  return usart_port_send_bytes_timeout(port, (uint8_t *)str, len, timeout_ms);
 }
 
-void usart_send_byte_blocking(uint8_t byte) {
-  // Wait for asynchronous send to be finished
-  while (_usart_is_sending)
-    ;
+uint16_t usart_port_dropped_bytes(usart_port_t port) {
+  uint16_t dropped = _usart_dropped[port];
+  _usart_dropped[port] = 0;
+  return dropped;
+}
+
+void usart_port_send_byte_blocking(usart_port_t port, uint8_t byte) {
+  const _usart_regs_t *regs = &_usart_regs[port];
+
+  // Sleep until the asynchronous send is finished
+  POWER_IDLE_WHILE(_usart_is_sending[port]);
 
   // Wait for Tx Buffer to become empty (check UDRE flag)
-  while (!(UCSR0A & (1 << UDRE0)))
+  while (!(*regs->ucsra & (1 << UDRE0)))
     ;
 
-  UDR0 = byte;
+  *regs->udr = byte;
 }
 
-void usart_send_bytes_blocking(const uint8_t *buf, uint8_t len) {
-  for (uint8_t i = 0; i < len; ++i)
-    usart_send_byte_blocking(buf[i]);
+void usart_port_send_bytes_blocking(usart_port_t port, const uint8_t *buf,
+                                    uint16_t len) {
+  for (uint16_t i = 0; i < len; ++i)
+    usart_port_send_byte_blocking(port, buf[i]);
 }
 
-void usart_send_string_blocking(const char *str) {
-  uint8_t idx = 0;
+void usart_port_send_string_blocking(usart_port_t port, const char *str) {
+  uint16_t idx = 0;
   while (str[idx] != '\0')
-    usart_send_byte_blocking(str[idx++]);
+    usart_port_send_byte_blocking(port, str[idx++]);
 }
 
-ISR(USART0_RX_vect) {
-  uint8_t val = UDR0;
+uint8_t usart_recv_into(uint8_t *recv_buf, uint8_t max_len) {
+  return usart_port_recv_into(USART_PORT0, recv_buf, max_len);
+}
 
-  circular_buffer_status_t status =
-      circular_buffer_write(&_usart_recv_buffer, &val, 1);
-  if (status != CIRCULAR_BUFFER_OK) {
-	  return;
-  }
+void usart_recv_drop_until_blocking(const char *needle, uint8_t *recv_buf,
+                                    uint8_t len) {
+  usart_port_recv_drop_until_blocking(USART_PORT0, needle, recv_buf, len);
+}
+
+uint8_t usart_recv_take_until_blocking(const char *needle, uint8_t *recv_buf,
+                                       uint8_t len) {
+  return usart_port_recv_take_until_blocking(USART_PORT0, needle, recv_buf,
+                                             len);
+}
+
+usart_match_status_t usart_recv_poll_drop_until(usart_matcher_t *matcher) {
+  return usart_port_recv_poll_drop_until(USART_PORT0, matcher);
+}
+
+usart_match_status_t usart_recv_poll_take_until(usart_matcher_t *matcher,
+                                                uint8_t *recv_buf,
+                                                uint8_t len) {
+  return usart_port_recv_poll_take_until(USART_PORT0, matcher, recv_buf, len);
+}
+
+bool usart_send_byte(uint8_t byte) {
+  return usart_port_send_byte(USART_PORT0, byte);
+}
+
+uint16_t usart_send_bytes(const uint8_t *buf, uint16_t len) {
+  return usart_port_send_bytes(USART_PORT0, buf, len);
 }
 
-ISR(USART0_UDRE_vect) {
+uint16_t usart_send_string(const char *str) {
+  return usart_port_send_string(USART_PORT0, str);
+}
+
+uint16_t usart_send_bytes_timeout(const uint8_t *buf, uint16_t len,
+                                  uint16_t timeout_ms) {
+  return usart_port_send_bytes_timeout(USART_PORT0, buf, len, timeout_ms);
+}
+
+uint16_t usart_send_string_timeout(const char *str, uint16_t timeout_ms) {
+  return usart_port_send_string_timeout(USART_PORT0, str, timeout_ms);
+}
+
+uint16_t usart_dropped_bytes() { return usart_port_dropped_bytes(USART_PORT0); }
+
+void usart_send_byte_blocking(uint8_t byte) {
+  usart_port_send_byte_blocking(USART_PORT0, byte);
+}
+
+void usart_send_bytes_blocking(const uint8_t *buf, uint16_t len) {
+  usart_port_send_bytes_blocking(USART_PORT0, buf, len);
+}
+
+void usart_send_string_blocking(const char *str) {
+  usart_port_send_string_blocking(USART_PORT0, str);
+}
+
+static inline void _usart_rx_isr(usart_port_t port) {
+  PROFILE_ISR_ENTER(PROFILE_USART_RX);
+  // NB! UDR has to be read even if the buffer is full (and the byte is
+  // dropped) to clear the interrupt.
+  _usart_rx_ring_push_byte(&_usart_recv_buffer[port], *_usart_regs[port].udr);
+  PROFILE_ISR_EXIT(PROFILE_USART_RX);
+}
+
+static inline void _usart_udre_isr(usart_port_t port) {
+  PROFILE_ISR_ENTER(PROFILE_USART_UDRE);
   // Data registry empty and ready to send new byte
   uint8_t data;
-  uint8_t n = circular_buffer_read_and_advance(&data, 1, &_usart_send_buffer);
-  if (n == 1) {
-    UDR0 = data;
-    _usart_is_sending = true;
-    UCSR0B |= (1 << UDRIE0);
+  if (_usart_tx_ring_pop_byte(&_usart_send_buffer[port], &data) ==
+      CIRCULAR_BUFFER_OK) {
+    *_usart_regs[port].udr = data;
   } else {
     // Disable interrupt and say that we are not sending
-    _usart_is_sending = false;
-    UCSR0B &= ~(1 << UDRIE0);
+    _usart_is_sending[port] = false;
+    *_usart_regs[port].ucsrb &= ~(1 << UDRIE0);
   }
+  PROFILE_ISR_EXIT(PROFILE_USART_UDRE);
 }
 
+ISR(USART0_RX_vect) { _usart_rx_isr(USART_PORT0); }
+ISR(USART0_UDRE_vect) { _usart_udre_isr(USART_PORT0); }
+
+#if USART_NUM_PORTS > 1
+ISR(USART1_RX_vect) { _usart_rx_isr(USART_PORT1); }
+ISR(USART1_UDRE_vect) { _usart_udre_isr(USART_PORT1); }
+#endif
+
+#if USART_NUM_PORTS > 2
+ISR(USART2_RX_vect) { _usart_rx_isr(USART_PORT2); }
+ISR(USART2_UDRE_vect) { _usart_udre_isr(USART_PORT2); }
+#endif
+
+#if USART_NUM_PORTS > 3
+ISR(USART3_RX_vect) { _usart_rx_isr(USART_PORT3); }
+ISR(USART3_UDRE_vect) { _usart_udre_isr(USART_PORT3); }
+#endif
+
 #endif /* ifndef AVRO_USART_H */
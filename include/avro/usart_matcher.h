@@ -0,0 +1,187 @@
+/******************************************************************************
+ * File:             usart_matcher.h
+ *
+ * Author:           Ole Martin Ruud
+ * Created:          10/14/26
+ * Description:      Incremental search for a needle in a stream of bytes, as
+ *                   used by the USART receive functions. Kept apart from
+ *                   usart.h as it does not depend on the hardware.
+ *****************************************************************************/
+
+#ifndef AVRO_USART_MATCHER_H
+#define AVRO_USART_MATCHER_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Longest needle which can be searched for by a usart_matcher_t.
+#ifndef USART_MATCH_MAX_NEEDLE
+#define USART_MATCH_MAX_NEEDLE 16
+#endif
+
+// PUBLIC
+
+typedef enum {
+  // The needle has not been found yet, poll again when more data arrived.
+  USART_MATCH_NEED_MORE,
+  // The needle was found.
+  USART_MATCH_FOUND,
+  // The receive buffer was filled before the needle was found.
+  USART_MATCH_FULL,
+} usart_match_status_t;
+
+// State of an incremental search for a needle in received data. Every byte
+// received is only looked at once, and a partial match of the needle is kept
+// across polls, so the search can be spread over many iterations of the main
+// loop. Initialize with usart_matcher_init before polling.
+typedef struct {
+  const char *needle;
+  uint8_t needle_len;
+  // Length of the prefix of the needle matched by the latest data.
+  uint8_t matched;
+  // Amount of bytes taken into the receive buffer, see
+  // usart_recv_poll_take_until.
+  uint8_t taken;
+  bool restart;
+  // Knuth-Morris-Pratt failure function, where fallback[i] is the length of
+  // the longest proper prefix of needle[0..i] which is also a suffix of it.
+  uint8_t fallback[USART_MATCH_MAX_NEEDLE];
+} usart_matcher_t;
+
+void usart_matcher_init(usart_matcher_t *matcher, const char *needle);
+
+// Feeds a single byte to the matcher and returns if the whole needle is
+// matched, after which matcher->matched is the length of the needle.
+bool usart_matcher_feed(usart_matcher_t *matcher, uint8_t byte);
+
+void usart_matcher_init(usart_matcher_t *matcher, const char *needle) {
+  uint8_t needle_len = strlen(needle);
+  assert(0 < needle_len && needle_len <= USART_MATCH_MAX_NEEDLE);
+
+  matcher->needle = needle;
+  matcher->needle_len = needle_len;
+  matcher->matched = 0;
+  matcher->taken = 0;
+  matcher->restart = false;
+
+  // Build the failure function by matching the needle against itself.
+  matcher->fallback[0] = 0;
+  uint8_t border = 0;
+  for (uint8_t i = 1; i < needle_len; ++i) {
+    while (border > 0 && needle[i] != needle[border])
+      border = matcher->fallback[border - 1];
+    if (needle[i] == needle[border])
+      border++;
+    matcher->fallback[i] = border;
+  }
+}
+
+bool usart_matcher_feed(usart_matcher_t *matcher, uint8_t byte) {
+  uint8_t matched = matcher->matched;
+  // On a mismatch, fall back to the longest partial match which can still be
+  // extended, instead of looking at previous data again.
+  while (matched > 0 && (uint8_t)matcher->needle[matched] != byte)
+    matched = matcher->fallback[matched - 1];
+  if ((uint8_t)matcher->needle[matched] == byte)
+    matched++;
+
+  matcher->matched = matched;
+  return matched == matcher->needle_len;
+}
+
+// GENERATED SCANS
+
+// Defines the scans polling for the needle in a circular buffer type
+// `ring##_t` (see CIRCULAR_BUFFER_DEFINE), as used by the USART receive
+// functions, which do not depend on the hardware:
+//  - `name##_poll_drop_until` drops the data before the needle, keeping the
+//    needle itself. A partial match is kept in the buffer, so the whole needle
+//    has to fit in it.
+//  - `name##_poll_take_until` moves the data before the needle into recv_buf
+//    of len bytes (including the terminating null), consuming the needle.
+// Both return USART_MATCH_NEED_MORE until the needle was found, see
+// usart_recv_poll_drop_until and usart_recv_poll_take_until.
+#define USART_MATCHER_RING_DEFINE(name, ring)                                 \
+  static inline usart_match_status_t name##_poll_drop_until(                  \
+      ring##_t *rb, usart_matcher_t *matcher) {                               \
+    const uint8_t *span;                                                      \
+    uint16_t span_len;                                                        \
+                                                                              \
+    /* The bytes of a partial match are kept in the ring, so continue */      \
+    /* scanning right after them. */                                          \
+    while ((span_len = ring##_peek_span_from(rb, matcher->matched, &span)) >  \
+           0) {                                                               \
+      uint16_t scanned = matcher->matched;                                    \
+                                                                              \
+      for (uint16_t i = 0; i < span_len; ++i) {                               \
+        scanned++;                                                            \
+        if (usart_matcher_feed(matcher, span[i])) {                           \
+          /* Drop everything before the needle, keeping the needle itself. */ \
+          ring##_consume(rb, scanned - matcher->needle_len);                  \
+          matcher->matched = 0;                                               \
+          return USART_MATCH_FOUND;                                           \
+        }                                                                     \
+      }                                                                       \
+                                                                              \
+      /* Everything which is not part of the partial match can be dropped. */ \
+      ring##_consume(rb, scanned - matcher->matched);                         \
+    }                                                                         \
+                                                                              \
+    return USART_MATCH_NEED_MORE;                                             \
+  }                                                                           \
+                                                                              \
+  static inline usart_match_status_t name##_poll_take_until(                  \
+      ring##_t *rb, usart_matcher_t *matcher, uint8_t *recv_buf,              \
+      uint8_t len) {                                                          \
+    const uint8_t *span;                                                      \
+    uint16_t span_len;                                                        \
+                                                                              \
+    if (matcher->restart) {                                                   \
+      matcher->taken = 0;                                                     \
+      matcher->restart = false;                                               \
+    }                                                                         \
+                                                                              \
+    while ((span_len = ring##_peek_span(rb, &span)) > 0) {                    \
+      for (uint16_t i = 0; i < span_len; ++i) {                               \
+        uint8_t prev_matched = matcher->matched;                              \
+                                                                              \
+        /* Stop if a mismatch could give more data than what fits. */         \
+        if (matcher->taken + prev_matched >= len - 1) {                       \
+          ring##_consume(rb, i);                                              \
+          recv_buf[matcher->taken] = '\0';                                    \
+          matcher->restart = true;                                            \
+          return USART_MATCH_FULL;                                            \
+        }                                                                     \
+                                                                              \
+        bool found = usart_matcher_feed(matcher, span[i]);                    \
+                                                                              \
+        /* The bytes which are no longer part of the partial match are */     \
+        /* data. As they were matched, they are the start of the needle */    \
+        /* followed by the new byte, so they can be taken from there. */      \
+        uint8_t mismatched = prev_matched + 1 - matcher->matched;             \
+        for (uint8_t j = 0; j < mismatched; ++j) {                            \
+          recv_buf[matcher->taken++] =                                        \
+              j < prev_matched ? matcher->needle[j] : span[i];                \
+        }                                                                     \
+                                                                              \
+        if (found) {                                                          \
+          /* Consume the data up to and including the needle. */              \
+          ring##_consume(rb, i + 1);                                          \
+          recv_buf[matcher->taken] = '\0';                                    \
+          matcher->matched = 0;                                               \
+          matcher->restart = true;                                            \
+          return USART_MATCH_FOUND;                                           \
+        }                                                                     \
+      }                                                                       \
+                                                                              \
+      /* Data of a partial match is kept in the matcher, so the bytes can */  \
+      /* be consumed right away. */                                           \
+      ring##_consume(rb, span_len);                                           \
+    }                                                                         \
+                                                                              \
+    return USART_MATCH_NEED_MORE;                                             \
+  }
+
+#endif /* ifndef AVRO_USART_MATCHER_H */
@@ -0,0 +1,250 @@
+// Benchmarks of the circular buffers and the USART matcher, reporting cycles
+// per byte and the worst case cycles of a single call.
+//
+// On the host, build and run with:
+//   gcc -O2 tests/bench_circular_buffer.c -o bench && ./bench
+// where cycles are read from the time stamp counter on x86, and are
+// nanoseconds elsewhere.
+//
+// On target (or in simavr), build with e.g.
+//   avr-gcc -mmcu=atmega2560 -DF_CPU=16000000UL -Os
+//     tests/bench_circular_buffer.c -o bench.elf
+// where cycles are counted by Timer1 without prescaling, and the results are
+// printed on USART0. The code size of each function is shown by
+//   avr-nm --size-sort -S bench.elf
+//
+// NB! Measurements include the overhead of reading the counter, which is
+// measured first and subtracted.
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/avro/circular_buffer.h"
+#include "../include/avro/usart_matcher.h"
+
+#ifdef __AVR__
+#include "../include/avro/usart.h"
+
+typedef uint16_t bench_cycles_t;
+
+static inline bench_cycles_t bench_now() { return TCNT1; }
+
+static int bench_putchar(char c, FILE *stream) {
+  (void)stream;
+  usart_send_byte_blocking(c);
+  return 0;
+}
+
+static void bench_init() {
+  // Timer1 in normal mode without prescaling, counting every cycle. NB! A
+  // single call must take less than 65536 cycles.
+  TCCR1A = 0;
+  TCCR1B = (1 << CS10);
+
+  static FILE usart_stdout =
+      FDEV_SETUP_STREAM(bench_putchar, NULL, _FDEV_SETUP_WRITE);
+  init_usart();
+  stdout = &usart_stdout;
+}
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+typedef uint64_t bench_cycles_t;
+
+static inline bench_cycles_t bench_now() { return __rdtsc(); }
+static void bench_init() {}
+#else
+#include <time.h>
+
+typedef uint64_t bench_cycles_t;
+
+static inline bench_cycles_t bench_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+static void bench_init() {}
+#endif
+
+#ifndef BENCH_ROUNDS
+#define BENCH_ROUNDS 1000
+#endif
+
+#define BENCH_BUFFER_SIZE 64
+#define BENCH_CHUNK 16
+
+CIRCULAR_BUFFER_POW2_DEFINE(bench_ring, BENCH_BUFFER_SIZE)
+
+typedef struct {
+  const char *name;
+  uint32_t calls;
+  uint32_t bytes;
+  uint32_t total;
+  bench_cycles_t worst;
+} bench_result_t;
+
+// Keeps the results of the benchmarked calls alive.
+volatile uint8_t bench_sink;
+
+bench_cycles_t bench_overhead;
+
+// Times the statement, adding the cycles to the result.
+#define BENCH_TIME(result, amount, statement)                                  \
+  do {                                                                         \
+    bench_cycles_t _start = bench_now();                                       \
+    statement;                                                                 \
+    bench_cycles_t _cycles = bench_now() - _start;                             \
+    _cycles = _cycles > bench_overhead ? _cycles - bench_overhead : 0;         \
+    (result)->calls++;                                                         \
+    (result)->bytes += (amount);                                               \
+    (result)->total += _cycles;                                                \
+    if (_cycles > (result)->worst)                                             \
+      (result)->worst = _cycles;                                               \
+  } while (0)
+
+void bench_measure_overhead() {
+  bench_overhead = (bench_cycles_t)-1;
+  for (uint16_t i = 0; i < BENCH_ROUNDS; ++i) {
+    bench_cycles_t start = bench_now();
+    bench_cycles_t cycles = bench_now() - start;
+    if (cycles < bench_overhead)
+      bench_overhead = cycles;
+  }
+}
+
+void bench_report(const bench_result_t *result) {
+  uint32_t per_byte_x100 =
+      result->bytes ? (uint32_t)((uint64_t)result->total * 100 / result->bytes)
+                    : 0;
+  printf("%-32s %6lu.%02lu cycles/byte %8lu worst cycles/call\n", result->name,
+         (unsigned long)(per_byte_x100 / 100),
+         (unsigned long)(per_byte_x100 % 100), (unsigned long)result->worst);
+}
+
+void circular_buffer_write_bench() {
+  bench_result_t write = {"circular_buffer_write", 0, 0, 0, 0};
+  bench_result_t read = {"circular_buffer_read_and_advance", 0, 0, 0, 0};
+  bench_result_t advance = {"circular_buffer_advance", 0, 0, 0, 0};
+
+  uint8_t data[BENCH_BUFFER_SIZE];
+  circular_buffer_t buf = {0, 0, data, BENCH_BUFFER_SIZE};
+  uint8_t chunk[BENCH_CHUNK] = {0};
+  uint8_t dest[BENCH_CHUNK];
+
+  // Odd amounts, so the indices hit every offset across the boundary
+  for (uint16_t i = 0; i < BENCH_ROUNDS; ++i) {
+    uint8_t len = 1 + i % (BENCH_CHUNK - 1);
+    BENCH_TIME(&write, len, circular_buffer_write(&buf, chunk, len));
+    uint8_t read_len;
+    BENCH_TIME(&read, len,
+               read_len = circular_buffer_read_and_advance(dest, len, &buf));
+    bench_sink = read_len;
+
+    circular_buffer_write(&buf, chunk, len);
+    BENCH_TIME(&advance, len, circular_buffer_advance(len, &buf));
+  }
+
+  bench_report(&write);
+  bench_report(&read);
+  bench_report(&advance);
+}
+
+void circular_buffer_pow2_bench() {
+  bench_result_t write = {"pow2_write", 0, 0, 0, 0};
+  bench_result_t read = {"pow2_read_and_advance", 0, 0, 0, 0};
+  bench_result_t push = {"pow2_push_byte", 0, 0, 0, 0};
+  bench_result_t pop = {"pow2_pop_byte", 0, 0, 0, 0};
+
+  bench_ring_t ring = {0};
+  uint8_t chunk[BENCH_CHUNK] = {0};
+  uint8_t dest[BENCH_CHUNK];
+
+  for (uint16_t i = 0; i < BENCH_ROUNDS; ++i) {
+    uint8_t len = 1 + i % (BENCH_CHUNK - 1);
+    BENCH_TIME(&write, len, bench_ring_write(&ring, chunk, len));
+    uint8_t read_len;
+    BENCH_TIME(&read, len,
+               read_len = bench_ring_read_and_advance(dest, len, &ring));
+    bench_sink = read_len;
+
+    // The byte functions are what the USART interrupts use
+    BENCH_TIME(&push, 1, bench_ring_push_byte(&ring, i));
+    uint8_t byte = 0;
+    BENCH_TIME(&pop, 1, bench_ring_pop_byte(&ring, &byte));
+    bench_sink = byte;
+  }
+
+  bench_report(&write);
+  bench_report(&read);
+  bench_report(&push);
+  bench_report(&pop);
+}
+
+// The scans of usart_recv_poll_drop_until and usart_recv_poll_take_until, on
+// a mocked receive ring.
+USART_MATCHER_RING_DEFINE(bench, bench_ring)
+
+void usart_matcher_bench() {
+  bench_result_t drop = {"usart_recv_poll_drop_until", 0, 0, 0, 0};
+  bench_result_t take = {"usart_recv_poll_take_until", 0, 0, 0, 0};
+  bench_result_t worst = {"usart_matcher_feed repetitive", 0, 0, 0, 0};
+
+  // A typical response, where the needle only matches at the end
+  const char *line = "+CSQ: 23,99\r\nOK\r\n";
+  uint8_t line_len = strlen(line);
+
+  bench_ring_t ring = {0};
+  usart_matcher_t matcher;
+  usart_matcher_init(&matcher, "OK\r\n");
+
+  for (uint16_t i = 0; i < BENCH_ROUNDS; ++i) {
+    bench_ring_write(&ring, (const uint8_t *)line, line_len);
+    usart_match_status_t status;
+    BENCH_TIME(&drop, line_len,
+               status = bench_poll_drop_until(&ring, &matcher));
+    bench_sink = status;
+    bench_ring_advance(bench_ring_len(&ring), &ring);
+  }
+
+  // Taking copies everything before the needle as well
+  uint8_t recv_buf[32];
+  for (uint16_t i = 0; i < BENCH_ROUNDS; ++i) {
+    bench_ring_write(&ring, (const uint8_t *)line, line_len);
+    usart_match_status_t status;
+    BENCH_TIME(&take, line_len,
+               status = bench_poll_take_until(&ring, &matcher, recv_buf,
+                                              sizeof(recv_buf)));
+    bench_sink = status;
+    bench_ring_advance(bench_ring_len(&ring), &ring);
+  }
+
+  // Repetitive data falls back the most, which is the worst case for the
+  // matcher.
+  usart_matcher_init(&matcher, "aaaab");
+  for (uint16_t i = 0; i < BENCH_ROUNDS; ++i) {
+    bool matched;
+    BENCH_TIME(&worst, 1,
+               matched = usart_matcher_feed(&matcher, i % 5 == 4 ? 'c' : 'a'));
+    bench_sink = matched;
+  }
+
+  bench_report(&drop);
+  bench_report(&take);
+  bench_report(&worst);
+}
+
+int main(void) {
+  bench_init();
+  bench_measure_overhead();
+
+  puts("######################################");
+  puts("Running benchmarks for circular buffer");
+  puts("######################################");
+  printf("Counter overhead: %lu cycles\n", (unsigned long)bench_overhead);
+
+  circular_buffer_write_bench();
+  circular_buffer_pow2_bench();
+  usart_matcher_bench();
+
+  return 0;
+}
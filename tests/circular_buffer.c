@@ -1,4 +1,7 @@
+// NB! Has to be built with -pthread for the stress tests.
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 
 #include "../include/avro/circular_buffer.h"
@@ -6,14 +9,33 @@
 #define TEST_START printf("Running: %s\n", __func__)
 #define TEST_END printf("Success: %s\n", __func__)
 
+CIRCULAR_BUFFER_POW2_DEFINE(test_ring, 8)
+CIRCULAR_BUFFER_DEFINE(test_wide_ring, uint16_t, 512)
+
 void circular_buffer_is_writable_test();
 void circular_buffer_is_readable_test();
 void circular_buffer_push_across_boundary_test();
 void circular_buffer_read_across_boundary_test();
 void circular_buffer_advance_test();
 void circular_buffer_advance_across_boundary_test();
-
-#define TESTS 6
+void circular_buffer_pow2_uses_all_slots_test();
+void circular_buffer_pow2_across_boundary_test();
+void circular_buffer_pow2_counter_overflow_test();
+void circular_buffer_pow2_advance_test();
+void circular_buffer_push_pop_byte_test();
+void circular_buffer_push_pop_byte_across_boundary_test();
+void circular_buffer_pow2_push_pop_byte_test();
+void circular_buffer_peek_span_across_boundary_test();
+void circular_buffer_claim_span_across_boundary_test();
+void circular_buffer_pow2_spans_test();
+void circular_buffer_write_keeps_free_slot_test();
+void circular_buffer_spsc_stress_test();
+void circular_buffer_pow2_spsc_stress_test();
+void circular_buffer_wide_large_write_test();
+void circular_buffer_wide_counter_overflow_test();
+void circular_buffer_pow2_peek_span_from_test();
+
+#define TESTS 22
 void (*tests[TESTS])() = {
     circular_buffer_is_writable_test,
     circular_buffer_is_readable_test,
@@ -21,6 +43,22 @@ void (*tests[TESTS])() = {
     circular_buffer_read_across_boundary_test,
     circular_buffer_advance_test,
     circular_buffer_advance_across_boundary_test,
+    circular_buffer_pow2_uses_all_slots_test,
+    circular_buffer_pow2_across_boundary_test,
+    circular_buffer_pow2_counter_overflow_test,
+    circular_buffer_pow2_advance_test,
+    circular_buffer_push_pop_byte_test,
+    circular_buffer_push_pop_byte_across_boundary_test,
+    circular_buffer_pow2_push_pop_byte_test,
+    circular_buffer_peek_span_across_boundary_test,
+    circular_buffer_claim_span_across_boundary_test,
+    circular_buffer_pow2_spans_test,
+    circular_buffer_write_keeps_free_slot_test,
+    circular_buffer_spsc_stress_test,
+    circular_buffer_pow2_spsc_stress_test,
+    circular_buffer_wide_large_write_test,
+    circular_buffer_wide_counter_overflow_test,
+    circular_buffer_pow2_peek_span_from_test,
 };
 
 int main(void) {
@@ -165,3 +203,590 @@ void circular_buffer_advance_across_boundary_test() {
 
   TEST_END;
 }
+
+void circular_buffer_pow2_uses_all_slots_test() {
+  TEST_START;
+
+  test_ring_t buf = {0};
+
+  uint8_t src[] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88};
+  assert(test_ring_write(&buf, src, sizeof(src)) == CIRCULAR_BUFFER_OK);
+  assert(test_ring_len(&buf) == 8);
+  assert(test_ring_write(&buf, src, 1) == CIRCULAR_BUFFER_FULL);
+
+  uint8_t dest[8];
+  assert(test_ring_read_and_advance(dest, sizeof(dest), &buf) == 8);
+  for (int i = 0; i < 8; ++i) {
+    assert(dest[i] == src[i]);
+  }
+  assert(test_ring_len(&buf) == 0);
+
+  TEST_END;
+}
+
+void circular_buffer_pow2_across_boundary_test() {
+  TEST_START;
+
+  test_ring_t buf = {
+      .head = 6,
+      .tail = 6,
+  };
+
+  uint8_t src[] = {0xff, 0xff, 0x11, 0x22, 0x33};
+  assert(test_ring_write(&buf, src, sizeof(src)) == CIRCULAR_BUFFER_OK);
+  assert(test_ring_len(&buf) == 5);
+  assert(buf.buf[7] == 0xff && buf.buf[0] == 0x11);
+
+  uint8_t dest[8];
+  assert(test_ring_read(dest, sizeof(dest), &buf) == 5);
+  for (int i = 0; i < 5; ++i) {
+    assert(dest[i] == src[i]);
+  }
+  assert(test_ring_len(&buf) == 5);
+
+  TEST_END;
+}
+
+void circular_buffer_pow2_counter_overflow_test() {
+  TEST_START;
+
+  // Counters close to overflowing should still give the correct length and
+  // position in the backing storage.
+  test_ring_t buf = {
+      .head = 254,
+      .tail = 254,
+  };
+
+  uint8_t src[] = {0x11, 0x22, 0x33, 0x44};
+  assert(test_ring_write(&buf, src, sizeof(src)) == CIRCULAR_BUFFER_OK);
+  assert(buf.head == 2);
+  assert(test_ring_len(&buf) == 4);
+
+  uint8_t dest[4];
+  assert(test_ring_read_and_advance(dest, sizeof(dest), &buf) == 4);
+  for (int i = 0; i < 4; ++i) {
+    assert(dest[i] == src[i]);
+  }
+  assert(test_ring_len(&buf) == 0);
+
+  TEST_END;
+}
+
+void circular_buffer_pow2_advance_test() {
+  TEST_START;
+
+  test_ring_t buf = {
+      .head = 3,
+      .tail = 252,
+  };
+
+  assert(test_ring_len(&buf) == 7);
+
+  test_ring_advance(3, &buf);
+  assert(test_ring_len(&buf) == 4);
+
+  // Advancing past the end simply empties the buffer
+  test_ring_advance(10, &buf);
+  assert(test_ring_len(&buf) == 0);
+
+  TEST_END;
+}
+
+void circular_buffer_push_pop_byte_test() {
+  TEST_START;
+
+  uint8_t _buf[5];
+  circular_buffer_t buf = {
+      .buf = _buf,
+      .len = sizeof(_buf),
+      .start = 0,
+      .end = 0,
+  };
+
+  uint8_t byte;
+  assert(circular_buffer_pop_byte(&buf, &byte) == CIRCULAR_BUFFER_EMPTY);
+
+  for (uint8_t i = 0; i < 5; ++i) {
+    assert(circular_buffer_push_byte(&buf, 0x11 * i) == CIRCULAR_BUFFER_OK);
+  }
+  assert(circular_buffer_push_byte(&buf, 0xff) == CIRCULAR_BUFFER_FULL);
+  assert(circular_buffer_len(&buf) == 5);
+
+  assert(circular_buffer_peek_byte(&buf, &byte) == CIRCULAR_BUFFER_OK);
+  assert(byte == 0x00);
+  assert(circular_buffer_len(&buf) == 5);
+
+  for (uint8_t i = 0; i < 5; ++i) {
+    assert(circular_buffer_pop_byte(&buf, &byte) == CIRCULAR_BUFFER_OK);
+    assert(byte == 0x11 * i);
+  }
+  assert(circular_buffer_pop_byte(&buf, &byte) == CIRCULAR_BUFFER_EMPTY);
+
+  TEST_END;
+}
+
+void circular_buffer_push_pop_byte_across_boundary_test() {
+  TEST_START;
+
+  uint8_t _buf[5];
+  circular_buffer_t buf = {
+      .buf = _buf,
+      .len = sizeof(_buf),
+      .start = 3,
+      .end = 3,
+  };
+
+  uint8_t src[] = {0x11, 0x22, 0x33, 0x44};
+  for (uint8_t i = 0; i < sizeof(src); ++i) {
+    assert(circular_buffer_push_byte(&buf, src[i]) == CIRCULAR_BUFFER_OK);
+  }
+  // One slot is always kept free when the data is non-continuos
+  assert(circular_buffer_push_byte(&buf, 0xff) == CIRCULAR_BUFFER_FULL);
+  assert(circular_buffer_len(&buf) == 4);
+
+  // Mixing with the bulk interface should see the same data
+  uint8_t dest[4];
+  assert(circular_buffer_read(dest, sizeof(dest), &buf) == 4);
+  for (int i = 0; i < 4; ++i) {
+    assert(dest[i] == src[i]);
+  }
+
+  uint8_t byte;
+  for (uint8_t i = 0; i < sizeof(src); ++i) {
+    assert(circular_buffer_pop_byte(&buf, &byte) == CIRCULAR_BUFFER_OK);
+    assert(byte == src[i]);
+  }
+  assert(circular_buffer_len(&buf) == 0);
+
+  TEST_END;
+}
+
+void circular_buffer_pow2_push_pop_byte_test() {
+  TEST_START;
+
+  test_ring_t buf = {
+      .head = 250,
+      .tail = 250,
+  };
+
+  uint8_t byte;
+  assert(test_ring_pop_byte(&buf, &byte) == CIRCULAR_BUFFER_EMPTY);
+
+  for (uint8_t i = 0; i < 8; ++i) {
+    assert(test_ring_push_byte(&buf, 0x11 * i) == CIRCULAR_BUFFER_OK);
+  }
+  assert(test_ring_push_byte(&buf, 0xff) == CIRCULAR_BUFFER_FULL);
+
+  assert(test_ring_peek_byte(&buf, &byte) == CIRCULAR_BUFFER_OK);
+  assert(byte == 0x00);
+
+  for (uint8_t i = 0; i < 8; ++i) {
+    assert(test_ring_pop_byte(&buf, &byte) == CIRCULAR_BUFFER_OK);
+    assert(byte == 0x11 * i);
+  }
+  assert(test_ring_pop_byte(&buf, &byte) == CIRCULAR_BUFFER_EMPTY);
+
+  TEST_END;
+}
+
+void circular_buffer_peek_span_across_boundary_test() {
+  TEST_START;
+
+  uint8_t _buf[5] = {0x11, 0x22, 0x33, 0x44, 0x55};
+  circular_buffer_t buf = {
+      .buf = _buf,
+      .len = sizeof(_buf),
+      .start = 3,
+      .end = 2,
+  };
+
+  const uint8_t *span;
+  assert(circular_buffer_peek_span(&buf, &span) == 2);
+  assert(span == _buf + 3);
+  circular_buffer_consume(&buf, 2);
+
+  assert(circular_buffer_peek_span(&buf, &span) == 2);
+  assert(span == _buf);
+  circular_buffer_consume(&buf, 2);
+
+  assert(circular_buffer_peek_span(&buf, &span) == 0);
+  assert(circular_buffer_len(&buf) == 0);
+
+  TEST_END;
+}
+
+void circular_buffer_claim_span_across_boundary_test() {
+  TEST_START;
+
+  uint8_t _buf[5];
+  circular_buffer_t buf = {
+      .buf = _buf,
+      .len = sizeof(_buf),
+      .start = 3,
+      .end = 3,
+  };
+
+  uint8_t *span;
+  assert(circular_buffer_claim_span(&buf, &span) == 2);
+  assert(span == _buf + 3);
+  span[0] = 0x11;
+  span[1] = 0x22;
+  circular_buffer_commit(&buf, 2);
+
+  // One slot is kept free before start
+  assert(circular_buffer_claim_span(&buf, &span) == 2);
+  assert(span == _buf);
+  span[0] = 0x33;
+  span[1] = 0x44;
+  circular_buffer_commit(&buf, 2);
+
+  assert(circular_buffer_claim_span(&buf, &span) == 0);
+  assert(circular_buffer_len(&buf) == 4);
+
+  uint8_t dest[4];
+  assert(circular_buffer_read(dest, sizeof(dest), &buf) == 4);
+  for (int i = 0; i < 4; ++i) {
+    assert(dest[i] == 0x11 * (i + 1));
+  }
+
+  TEST_END;
+}
+
+void circular_buffer_pow2_spans_test() {
+  TEST_START;
+
+  test_ring_t buf = {
+      .head = 6,
+      .tail = 6,
+  };
+
+  uint8_t *wspan;
+  assert(test_ring_claim_span(&buf, &wspan) == 2);
+  wspan[0] = 0x11;
+  wspan[1] = 0x22;
+  test_ring_commit(&buf, 2);
+
+  assert(test_ring_claim_span(&buf, &wspan) == 6);
+  assert(wspan == buf.buf);
+  wspan[0] = 0x33;
+  test_ring_commit(&buf, 1);
+
+  const uint8_t *rspan;
+  assert(test_ring_peek_span(&buf, &rspan) == 2);
+  assert(rspan[0] == 0x11 && rspan[1] == 0x22);
+  test_ring_consume(&buf, 2);
+
+  assert(test_ring_peek_span(&buf, &rspan) == 1);
+  assert(rspan[0] == 0x33);
+  test_ring_consume(&buf, 1);
+
+  assert(test_ring_peek_span(&buf, &rspan) == 0);
+
+  TEST_END;
+}
+
+void circular_buffer_write_keeps_free_slot_test() {
+  TEST_START;
+
+  uint8_t _buf[5];
+  circular_buffer_t buf = {
+      .buf = _buf,
+      .len = sizeof(_buf),
+      .start = 2,
+      .end = 2,
+  };
+
+  // Filling every slot while wrapping around would make end equal start,
+  // which looks like an empty buffer.
+  uint8_t src[] = {0x11, 0x22, 0x33, 0x44, 0x55};
+  assert(circular_buffer_write(&buf, src, 5) == CIRCULAR_BUFFER_FULL);
+  assert(circular_buffer_write(&buf, src, 4) == CIRCULAR_BUFFER_OK);
+  assert(circular_buffer_len(&buf) == 4);
+  assert(circular_buffer_write(&buf, src, 1) == CIRCULAR_BUFFER_FULL);
+
+  TEST_END;
+}
+
+// The stress tests run a producer and a consumer thread against the same
+// buffer, mixing the different interfaces. The producer writes an increasing
+// sequence and the consumer checks that it is read back in order, which
+// fails if data is seen before it is written or overwritten before it is read.
+// A thread which could not make progress yields, so the test also runs
+// reasonably fast on a single core.
+#define STRESS_BYTES 1000000
+
+void *circular_buffer_stress_producer(void *arg) {
+  circular_buffer_t *buf = arg;
+  uint32_t seq = 0;
+
+  while (seq < STRESS_BYTES) {
+    uint32_t prev_seq = seq;
+
+    if (seq % 3 == 0) {
+      uint8_t src[7];
+      uint8_t len = STRESS_BYTES - seq < sizeof(src) ? STRESS_BYTES - seq
+                                                      : sizeof(src);
+      for (uint8_t i = 0; i < len; ++i) {
+        src[i] = (uint8_t)(seq + i);
+      }
+      if (circular_buffer_write(buf, src, len) == CIRCULAR_BUFFER_OK) {
+        seq += len;
+      }
+    } else if (seq % 3 == 1) {
+      uint8_t *span;
+      uint8_t len = circular_buffer_claim_span(buf, &span);
+      len = STRESS_BYTES - seq < len ? STRESS_BYTES - seq : len;
+      for (uint8_t i = 0; i < len; ++i) {
+        span[i] = (uint8_t)(seq + i);
+      }
+      circular_buffer_commit(buf, len);
+      seq += len;
+    } else {
+      if (circular_buffer_push_byte(buf, (uint8_t)seq) == CIRCULAR_BUFFER_OK) {
+        seq++;
+      }
+    }
+
+    if (seq == prev_seq) {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+void *circular_buffer_stress_consumer(void *arg) {
+  circular_buffer_t *buf = arg;
+  uint32_t seq = 0;
+
+  while (seq < STRESS_BYTES) {
+    uint32_t prev_seq = seq;
+
+    if (seq % 3 == 0) {
+      uint8_t dest[5];
+      uint8_t len = circular_buffer_read_and_advance(dest, sizeof(dest), buf);
+      for (uint8_t i = 0; i < len; ++i) {
+        assert(dest[i] == (uint8_t)(seq + i));
+      }
+      seq += len;
+    } else if (seq % 3 == 1) {
+      const uint8_t *span;
+      uint8_t len = circular_buffer_peek_span(buf, &span);
+      for (uint8_t i = 0; i < len; ++i) {
+        assert(span[i] == (uint8_t)(seq + i));
+      }
+      circular_buffer_consume(buf, len);
+      seq += len;
+    } else {
+      uint8_t byte;
+      if (circular_buffer_pop_byte(buf, &byte) == CIRCULAR_BUFFER_OK) {
+        assert(byte == (uint8_t)seq);
+        seq++;
+      }
+    }
+
+    if (seq == prev_seq) {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+void circular_buffer_spsc_stress_test() {
+  TEST_START;
+
+  uint8_t _buf[13];
+  circular_buffer_t buf = {
+      .buf = _buf,
+      .len = sizeof(_buf),
+      .start = 0,
+      .end = 0,
+  };
+
+  pthread_t producer, consumer;
+  pthread_create(&producer, NULL, circular_buffer_stress_producer, &buf);
+  pthread_create(&consumer, NULL, circular_buffer_stress_consumer, &buf);
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+
+  assert(circular_buffer_len(&buf) == 0);
+
+  TEST_END;
+}
+
+void *circular_buffer_pow2_stress_producer(void *arg) {
+  test_ring_t *buf = arg;
+  uint32_t seq = 0;
+
+  while (seq < STRESS_BYTES) {
+    uint32_t prev_seq = seq;
+
+    if (seq % 3 == 0) {
+      uint8_t src[5];
+      uint8_t len = STRESS_BYTES - seq < sizeof(src) ? STRESS_BYTES - seq
+                                                      : sizeof(src);
+      for (uint8_t i = 0; i < len; ++i) {
+        src[i] = (uint8_t)(seq + i);
+      }
+      if (test_ring_write(buf, src, len) == CIRCULAR_BUFFER_OK) {
+        seq += len;
+      }
+    } else if (seq % 3 == 1) {
+      uint8_t *span;
+      uint8_t len = test_ring_claim_span(buf, &span);
+      len = STRESS_BYTES - seq < len ? STRESS_BYTES - seq : len;
+      for (uint8_t i = 0; i < len; ++i) {
+        span[i] = (uint8_t)(seq + i);
+      }
+      test_ring_commit(buf, len);
+      seq += len;
+    } else {
+      if (test_ring_push_byte(buf, (uint8_t)seq) == CIRCULAR_BUFFER_OK) {
+        seq++;
+      }
+    }
+
+    if (seq == prev_seq) {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+void *circular_buffer_pow2_stress_consumer(void *arg) {
+  test_ring_t *buf = arg;
+  uint32_t seq = 0;
+
+  while (seq < STRESS_BYTES) {
+    uint32_t prev_seq = seq;
+
+    if (seq % 3 == 0) {
+      uint8_t dest[3];
+      uint8_t len = test_ring_read_and_advance(dest, sizeof(dest), buf);
+      for (uint8_t i = 0; i < len; ++i) {
+        assert(dest[i] == (uint8_t)(seq + i));
+      }
+      seq += len;
+    } else if (seq % 3 == 1) {
+      const uint8_t *span;
+      uint8_t len = test_ring_peek_span(buf, &span);
+      for (uint8_t i = 0; i < len; ++i) {
+        assert(span[i] == (uint8_t)(seq + i));
+      }
+      test_ring_consume(buf, len);
+      seq += len;
+    } else {
+      uint8_t byte;
+      if (test_ring_pop_byte(buf, &byte) == CIRCULAR_BUFFER_OK) {
+        assert(byte == (uint8_t)seq);
+        seq++;
+      }
+    }
+
+    if (seq == prev_seq) {
+      sched_yield();
+    }
+  }
+
+  return NULL;
+}
+
+void circular_buffer_pow2_spsc_stress_test() {
+  TEST_START;
+
+  test_ring_t buf = {0};
+
+  pthread_t producer, consumer;
+  pthread_create(&producer, NULL, circular_buffer_pow2_stress_producer, &buf);
+  pthread_create(&consumer, NULL, circular_buffer_pow2_stress_consumer, &buf);
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+
+  assert(test_ring_len(&buf) == 0);
+
+  TEST_END;
+}
+
+void circular_buffer_wide_large_write_test() {
+  TEST_START;
+
+  test_wide_ring_t buf = {0};
+
+  uint8_t src[300];
+  for (uint16_t i = 0; i < sizeof(src); ++i) {
+    src[i] = (uint8_t)i;
+  }
+
+  assert(test_wide_ring_write(&buf, src, sizeof(src)) == CIRCULAR_BUFFER_OK);
+  assert(test_wide_ring_write(&buf, src, sizeof(src)) == CIRCULAR_BUFFER_FULL);
+  assert(test_wide_ring_len(&buf) == 300);
+
+  uint8_t dest[300];
+  assert(test_wide_ring_read_and_advance(dest, sizeof(dest), &buf) == 300);
+  for (uint16_t i = 0; i < sizeof(dest); ++i) {
+    assert(dest[i] == src[i]);
+  }
+
+  // The second write wraps around the backing storage
+  assert(test_wide_ring_write(&buf, src, sizeof(src)) == CIRCULAR_BUFFER_OK);
+  assert(test_wide_ring_read_and_advance(dest, sizeof(dest), &buf) == 300);
+  for (uint16_t i = 0; i < sizeof(dest); ++i) {
+    assert(dest[i] == src[i]);
+  }
+
+  TEST_END;
+}
+
+void circular_buffer_wide_counter_overflow_test() {
+  TEST_START;
+
+  test_wide_ring_t buf = {
+      .head = 65500,
+      .tail = 65500,
+  };
+
+  uint8_t src[100];
+  for (uint16_t i = 0; i < sizeof(src); ++i) {
+    src[i] = (uint8_t)(i * 3);
+  }
+
+  assert(test_wide_ring_write(&buf, src, sizeof(src)) == CIRCULAR_BUFFER_OK);
+  assert(buf.head == 64);
+  assert(test_wide_ring_len(&buf) == 100);
+
+  uint8_t byte;
+  for (uint16_t i = 0; i < sizeof(src); ++i) {
+    assert(test_wide_ring_pop_byte(&buf, &byte) == CIRCULAR_BUFFER_OK);
+    assert(byte == src[i]);
+  }
+  assert(test_wide_ring_len(&buf) == 0);
+
+  TEST_END;
+}
+
+void circular_buffer_pow2_peek_span_from_test() {
+  TEST_START;
+
+  test_ring_t buf = {
+      .head = 5,
+      .tail = 5,
+  };
+
+  uint8_t src[] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+  assert(test_ring_write(&buf, src, sizeof(src)) == CIRCULAR_BUFFER_OK);
+
+  const uint8_t *span;
+  assert(test_ring_peek_span_from(&buf, 1, &span) == 2);
+  assert(span[0] == 0x22 && span[1] == 0x33);
+
+  // Offsets past the boundary continue from the front
+  assert(test_ring_peek_span_from(&buf, 4, &span) == 2);
+  assert(span[0] == 0x55 && span[1] == 0x66);
+
+  assert(test_ring_peek_span_from(&buf, 6, &span) == 0);
+  assert(test_ring_len(&buf) == 6);
+
+  TEST_END;
+}
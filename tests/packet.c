@@ -0,0 +1,304 @@
+// Tests of the COBS framing and CRC of packet.h, where USART is mocked by a
+// send buffer which the sent frames are written to, and a receive ring which
+// the frames are fed back through.
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/avro/circular_buffer.h"
+
+#define TEST_START printf("Running: %s\n", __func__)
+#define TEST_END printf("Success: %s\n", __func__)
+
+// The mocked parts of usart.h used by packet.h
+#define AVRO_USART_H
+#define USART_NUM_PORTS 1
+
+typedef enum {
+  USART_PORT0,
+} usart_port_t;
+
+CIRCULAR_BUFFER_DEFINE(_usart_rx_ring, uint16_t, 1024)
+
+_usart_rx_ring_t _usart_recv_buffer[USART_NUM_PORTS];
+
+uint8_t mock_sent[1024];
+uint16_t mock_sent_len = 0;
+// Bytes which fit in the mocked send buffer before sends are cut short
+uint16_t mock_send_room = sizeof(mock_sent);
+
+uint16_t usart_port_send_bytes_timeout(usart_port_t port, const uint8_t *buf,
+                                       uint16_t len, uint16_t timeout_ms) {
+  (void)port;
+  (void)timeout_ms;
+  uint16_t room = mock_send_room - mock_sent_len;
+  uint16_t queued = len < room ? len : room;
+  memcpy(mock_sent + mock_sent_len, buf, queued);
+  mock_sent_len += queued;
+  return queued;
+}
+
+// The largest payload a packet can have, so full COBS runs fit
+#define PACKET_MAX_PAYLOAD 255
+#include "../include/avro/packet.h"
+
+uint8_t received[PACKET_MAX_PAYLOAD];
+uint8_t received_len;
+uint16_t received_count;
+
+void on_packet(const uint8_t *payload, uint8_t len) {
+  memcpy(received, payload, len);
+  received_len = len;
+  received_count++;
+}
+
+packet_receiver_t receiver;
+
+void reset() {
+  mock_sent_len = 0;
+  mock_send_room = sizeof(mock_sent);
+  _usart_recv_buffer[0] = (_usart_rx_ring_t){0};
+  _packet_resync[0] = false;
+  received_len = 0;
+  received_count = 0;
+  packet_receiver_init(&receiver, USART_PORT0, on_packet);
+}
+
+// Feeds everything sent back through the receive ring, and polls it.
+void loop_back() {
+  assert(_usart_rx_ring_write(&_usart_recv_buffer[0], mock_sent,
+                              mock_sent_len) == CIRCULAR_BUFFER_OK);
+  mock_sent_len = 0;
+  packet_poll(&receiver);
+}
+
+void receive_raw(const uint8_t *data, uint16_t len) {
+  assert(_usart_rx_ring_write(&_usart_recv_buffer[0], data, len) ==
+         CIRCULAR_BUFFER_OK);
+  packet_poll(&receiver);
+}
+
+// Checks that the sent frame has no zeros but the one ending it.
+void assert_framed(const uint8_t *frame, uint16_t len) {
+  assert(len > 0 && frame[len - 1] == 0);
+  for (uint16_t i = 0; i + 1 < len; ++i)
+    assert(frame[i] != 0);
+}
+
+void assert_round_trip(const uint8_t *payload, uint8_t len) {
+  reset();
+  assert(packet_send(payload, len));
+  assert_framed(mock_sent, mock_sent_len);
+  loop_back();
+  assert(received_count == 1);
+  assert(received_len == len);
+  assert(memcmp(received, payload, len) == 0);
+  assert(receiver.dropped == 0);
+}
+
+void packet_round_trip_test();
+void packet_zeros_round_trip_test();
+void packet_full_run_test();
+void packet_back_to_back_delimiters_test();
+void packet_split_delivery_test();
+void packet_bad_crc_test();
+void packet_overflow_test();
+void packet_resync_test();
+
+#define TESTS 8
+void (*tests[TESTS])() = {
+    packet_round_trip_test,
+    packet_zeros_round_trip_test,
+    packet_full_run_test,
+    packet_back_to_back_delimiters_test,
+    packet_split_delivery_test,
+    packet_bad_crc_test,
+    packet_overflow_test,
+    packet_resync_test,
+};
+
+int main(void) {
+  puts("#################################");
+  puts("Running tests for packet");
+  puts("#################################");
+
+  for (int i = 0; i < TESTS; ++i) {
+    (*tests[i])();
+  }
+
+  puts("#################################");
+  puts("Tests successful!");
+  puts("#################################");
+
+  return 0;
+}
+
+void packet_round_trip_test() {
+  TEST_START;
+
+  const uint8_t payload[] = {0x11, 0x22, 0x33};
+  assert_round_trip(payload, sizeof(payload));
+
+  // An empty payload is still sent as its CRC
+  assert_round_trip(payload, 0);
+
+  TEST_END;
+}
+
+void packet_zeros_round_trip_test() {
+  TEST_START;
+
+  const uint8_t single[] = {0x00};
+  assert_round_trip(single, sizeof(single));
+
+  // A trailing zero, which ends a block right before the CRC
+  const uint8_t trailing[] = {0x01, 0x02, 0x00};
+  assert_round_trip(trailing, sizeof(trailing));
+
+  const uint8_t zeros[] = {0x00, 0x00, 0x00};
+  assert_round_trip(zeros, sizeof(zeros));
+
+  TEST_END;
+}
+
+void packet_full_run_test() {
+  TEST_START;
+
+  // 254 non-zero bytes fill a block, which then has no zero after it
+  uint8_t payload[255];
+  for (uint16_t i = 0; i < sizeof(payload); ++i)
+    payload[i] = 1 + i % 255;
+
+  assert_round_trip(payload, 254);
+  assert_round_trip(payload, 255);
+
+  // The frame starts with a full block
+  reset();
+  assert(packet_send(payload, 254));
+  assert(mock_sent[0] == _PACKET_COBS_MAX_RUN + 1);
+  assert(memcmp(mock_sent + 1, payload, 254) == 0);
+
+  // A zero right after a full run starts a block of its own
+  payload[254] = 0x00;
+  assert_round_trip(payload, 255);
+
+  TEST_END;
+}
+
+void packet_back_to_back_delimiters_test() {
+  TEST_START;
+
+  reset();
+  const uint8_t zeros[] = {0x00, 0x00, 0x00};
+  receive_raw(zeros, sizeof(zeros));
+
+  const uint8_t payload[] = {0xab, 0xcd};
+  assert(packet_send(payload, sizeof(payload)));
+  loop_back();
+  receive_raw(zeros, sizeof(zeros));
+
+  // Empty packets are used to resynchronize, so they are not dropped
+  assert(received_count == 1);
+  assert(received_len == sizeof(payload));
+  assert(receiver.dropped == 0);
+
+  TEST_END;
+}
+
+void packet_split_delivery_test() {
+  TEST_START;
+
+  reset();
+  const uint8_t payload[] = {0x00, 0x10, 0x00, 0x20};
+  assert(packet_send(payload, sizeof(payload)));
+
+  // Blocks cut across polls continue where they left off
+  uint8_t frame[sizeof(mock_sent)];
+  uint16_t frame_len = mock_sent_len;
+  memcpy(frame, mock_sent, frame_len);
+  for (uint16_t i = 0; i < frame_len; ++i) {
+    assert(received_count == 0);
+    receive_raw(frame + i, 1);
+  }
+
+  assert(received_count == 1);
+  assert(memcmp(received, payload, sizeof(payload)) == 0);
+
+  TEST_END;
+}
+
+void packet_bad_crc_test() {
+  TEST_START;
+
+  reset();
+  const uint8_t payload[] = {0x01, 0x02, 0x03, 0x04};
+  assert(packet_send(payload, sizeof(payload)));
+
+  // Corrupt a data byte, keeping the framing intact
+  mock_sent[2] ^= 0x40;
+  loop_back();
+  assert(received_count == 0);
+  assert(receiver.dropped == 1);
+
+  // The next packet is received as usual
+  assert(packet_send(payload, sizeof(payload)));
+  loop_back();
+  assert(received_count == 1);
+  assert(receiver.dropped == 1);
+
+  TEST_END;
+}
+
+void packet_overflow_test() {
+  TEST_START;
+
+  reset();
+
+  // Two full blocks are more than fits in the payload and CRC
+  uint8_t frame[2 * (_PACKET_COBS_MAX_RUN + 1) + 1];
+  memset(frame, 0x11, sizeof(frame));
+  frame[0] = _PACKET_COBS_MAX_RUN + 1;
+  frame[_PACKET_COBS_MAX_RUN + 1] = _PACKET_COBS_MAX_RUN + 1;
+  frame[sizeof(frame) - 1] = 0x00;
+  receive_raw(frame, sizeof(frame));
+
+  assert(received_count == 0);
+  assert(receiver.dropped == 1);
+  assert(!receiver.overflow);
+
+  const uint8_t payload[] = {0x42};
+  assert(packet_send(payload, sizeof(payload)));
+  loop_back();
+  assert(received_count == 1);
+  assert(received[0] == 0x42);
+
+  TEST_END;
+}
+
+void packet_resync_test() {
+  TEST_START;
+
+  reset();
+  const uint8_t first[] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06};
+  const uint8_t second[] = {0x07, 0x08};
+
+  // Cut the first packet short, as if the send buffer stayed full
+  mock_send_room = 4;
+  assert(!packet_send(first, sizeof(first)));
+  assert(_packet_resync[0]);
+
+  // The next packet first ends the cut one with a zero
+  mock_send_room = sizeof(mock_sent);
+  uint16_t cut_len = mock_sent_len;
+  assert(packet_send(second, sizeof(second)));
+  assert(mock_sent[cut_len] == 0x00);
+  assert(!_packet_resync[0]);
+
+  loop_back();
+  assert(received_count == 1);
+  assert(received_len == sizeof(second));
+  assert(memcmp(received, second, sizeof(second)) == 0);
+  assert(receiver.dropped == 1);
+
+  TEST_END;
+}